@@ -0,0 +1,272 @@
+// Microbenchmarks of the request handlers, run in-process without sockets.
+// Build: gcc -O2 bench.c -o bench -pthread
+// Usage: ./bench [flights ...]   (default: 4 1000 100000 1000000)
+//
+// Each data set is written as synthetic vols.txt/facture.txt files in a temporary
+// directory, imported into a flight store and loaded by a fresh child process, exactly as
+// the server would at first startup.
+// Replies are captured in memory (the same path as binary TCP frames) and journal
+// syncs are deferred, so the numbers are the CPU cost of each handler.
+#define SERVEUR_NO_MAIN
+#include "serveur.c"
+
+#include <sys/wait.h>
+
+#define BENCH_SOCK 1000000        // Never a real descriptor, replies go to the capture buffer
+#define BENCH_MIN_NS 200000000LL  // Run each operation for at least 200 ms
+#define BENCH_MIN_OPS 16
+
+// Allocation counter: the benchmark binary interposes the libc allocator.
+// Only the benchmark thread is counted, the journal and history threads are not.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+__thread uint64_t bench_allocs = 0;
+
+void *malloc(size_t size) {
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+typedef enum {
+    BENCH_RESERVER,
+    BENCH_ANNULER,
+    BENCH_LIST_CACHED,   // Nothing changed since the previous LIST
+    BENCH_LIST_CHANGED,  // A booking happened in between, the reply is rebuilt
+    BENCH_UPDATE_FACTURE,
+    BENCH_FACTURE,
+    BENCH_SEARCH,        // One destination, a 100 Dt price range
+    BENCH_PAGE,          // LIST_PAGE_DEFAULT flights from a random cursor
+    BENCH_NB_OPS
+} BenchOp;
+
+const char *bench_op_names[BENCH_NB_OPS] = {
+    "reserverVol", "annulerVol", "sendVols", "sendVols (changed)", "updateFacture", "consulterFacture", "rechercherVols", "sendVolsPage"
+};
+
+FrameCapture bench_capture = { BENCH_SOCK, NULL, 0, 0 };
+struct sockaddr_in bench_addr;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Write count flights and as many agencies with an open invoice
+int bench_generate(const char *dir, size_t count) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, VOL_FILE);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("Failed to create flights file");
+        return -1;
+    }
+    fprintf(f, "Référence Vol  Destination  Nombre Places  Prix Place\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(f, "%zu Dest%zu %d %zu\n", 1000 + i, i % 500, 1000000, 100 + i % 4000);
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, FACTURE_FILE);
+    f = fopen(path, "w");
+    if (!f) {
+        perror("Failed to create invoices file");
+        return -1;
+    }
+    fprintf(f, "Référence Agence  Somme à payer\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(f, "agence%zu %zu\n", i, 500 + i % 10000);
+    }
+    fclose(f);
+    return 0;
+}
+
+void bench_run_op(BenchOp op, unsigned int *rnd) {
+    int ref = 1000 + (int)(rand_r(rnd) % nb_vols);
+    char agence[50];
+    snprintf(agence, sizeof(agence), "agence%zu", rand_r(rnd) % nb_vols);
+    socklen_t len = sizeof(bench_addr);
+    switch (op) {
+        case BENCH_RESERVER:
+            reserverVol(BENCH_SOCK, &bench_addr, len, ref, 1, agence, PROTO_TCP, 0);
+            break;
+        case BENCH_ANNULER:
+            annulerVol(BENCH_SOCK, &bench_addr, len, ref, 1, agence, PROTO_TCP, 0);
+            break;
+        case BENCH_LIST_CACHED:
+        case BENCH_LIST_CHANGED:
+            sendVols(BENCH_SOCK, &bench_addr, len, PROTO_TCP, 0);
+            break;
+        case BENCH_UPDATE_FACTURE:
+            updateFacture(BENCH_SOCK, &bench_addr, agence, 100);
+            break;
+        case BENCH_FACTURE:
+            consulterFacture(BENCH_SOCK, &bench_addr, len, agence, PROTO_TCP, 0);
+            break;
+        case BENCH_SEARCH: {
+            char dest[VOL_DEST_SIZE];
+            int prix = 100 + (int)(rand_r(rnd) % 3900);
+            snprintf(dest, sizeof(dest), "Dest%d", rand_r(rnd) % 500);
+            rechercherVols(BENCH_SOCK, &bench_addr, len, dest, prix, prix + 100, 1, PROTO_TCP, 0);
+            break;
+        }
+        case BENCH_PAGE: {
+            char cursor[LIST_CURSOR_SIZE];
+            size_t pos = rand_r(rnd) % nb_vols;
+            snprintf(cursor, sizeof(cursor), "%zx.%x", pos, (unsigned int)vols[pos].ref);
+            sendVolsPage(BENCH_SOCK, &bench_addr, len, cursor, LIST_PAGE_DEFAULT, PROTO_TCP, 0);
+            break;
+        }
+        case BENCH_NB_OPS:
+            break;
+    }
+    bench_capture.len = 0;
+}
+
+void bench_measure(BenchOp op) {
+    unsigned int rnd = 42;
+    long long elapsed = 0;
+    uint64_t ops = 0, allocs = 0;
+    while (elapsed < BENCH_MIN_NS || ops < BENCH_MIN_OPS) {
+        if (op == BENCH_LIST_CHANGED) {
+            __atomic_add_fetch(&vols_version, 1, __ATOMIC_RELEASE); // Untimed stand-in for a booking
+        }
+        uint64_t a = bench_allocs;
+        long long start = now_ns();
+        bench_run_op(op, &rnd);
+        elapsed += now_ns() - start;
+        allocs += bench_allocs - a;
+        ops++;
+    }
+    printf("%10zu  %-20s %12.0f %10.2f %10llu\n", nb_vols, bench_op_names[op], (double)elapsed / ops,
+           (double)allocs / ops, (unsigned long long)ops);
+
+    // Let the deferred journal records reach the disk before the next operation
+    journal_defer = 0;
+    journal_wait(journal_deferred_lsn);
+    journal_defer = 1;
+    journal_deferred_lsn = 0;
+}
+
+// Runs in a child process: the server keeps its tables in globals, loaded once
+int bench_dataset(const char *dir) {
+    if (chdir(dir) < 0) {
+        perror("Failed to enter data set directory");
+        return 1;
+    }
+    long long start = now_ns();
+    if (vol_store_import(VOL_FILE, VOL_STORE_FILE) < 0) {
+        return 1;
+    }
+    long long imported = now_ns();
+    if (chargerVols(VOL_STORE_FILE, VOL_FILE) < 0) {
+        return 1;
+    }
+    long long mapped = now_ns();
+    if (chargerFactures(FACTURE_FILE) < 0 || journal_open(JOURNAL_FILE) < 0 || histo_open(HISTO_FILE) < 0) {
+        return 1;
+    }
+    printf("%10zu  %-20s %12.0f %10s %10d\n", nb_vols, "import", (double)(imported - start), "-", 1);
+    printf("%10zu  %-20s %12.0f %10s %10d\n", nb_vols, "load", (double)(mapped - imported), "-", 1);
+    pthread_t journal_thread;
+    if (pthread_create(&journal_thread, NULL, journal_writer_thread, NULL) != 0) {
+        perror("Failed to create journal thread");
+        return 1;
+    }
+    pthread_detach(journal_thread);
+
+    memset(&bench_addr, 0, sizeof(bench_addr));
+    bench_addr.sin_family = AF_INET;
+    bench_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcp_capture = &bench_capture;
+    journal_defer = 1;
+    for (int op = 0; op < BENCH_NB_OPS; op++) {
+        bench_measure(op);
+    }
+
+    // The group commit only stalls for the fork, the child writes the checkpoint
+    journal_defer = 0;
+    journal_wait(journal_deferred_lsn);
+    long long fork_start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(checkpoint_write(journal_durable_lsn) == 0 ? 0 : 1);
+    }
+    long long forked = now_ns();
+    int status = 1;
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    long long written = now_ns();
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Checkpoint failed\n");
+        return 1;
+    }
+    printf("%10zu  %-20s %12.0f %10s %10d\n", nb_vols, "checkpoint fork", (double)(forked - fork_start), "-", 1);
+    printf("%10zu  %-20s %12.0f %10s %10d\n", nb_vols, "checkpoint", (double)(written - fork_start), "-", 1);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    setenv("LOG_LEVEL", "error", 0);
+    size_t default_sizes[] = { 4, 1000, 100000, 1000000 };
+    size_t nb_sizes = argc > 1 ? (size_t)(argc - 1) : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+    printf("%10s  %-20s %12s %10s %10s\n", "flights", "operation", "ns/op", "allocs/op", "ops");
+    fflush(stdout);
+    for (size_t i = 0; i < nb_sizes; i++) {
+        size_t size = argc > 1 ? strtoul(argv[i + 1], NULL, 10) : default_sizes[i];
+        if (size == 0) {
+            fprintf(stderr, "Usage: %s [flights ...]\n", argv[0]);
+            return 1;
+        }
+        char dir[] = "/tmp/flight-bench.XXXXXX";
+        if (!mkdtemp(dir) || bench_generate(dir, size) < 0) {
+            perror("Failed to prepare data set");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (log_init() < 0) {
+                _exit(1);
+            }
+            _exit(bench_dataset(dir) == 0 ? 0 : 1);
+        }
+        int status = 1;
+        if (pid < 0) {
+            perror("Failed to fork");
+        } else {
+            waitpid(pid, &status, 0);
+        }
+        const char *files[] = { VOL_FILE, VOL_STORE_FILE, FACTURE_FILE, JOURNAL_FILE, JOURNAL_SEGMENT_FILE, HISTO_FILE };
+        for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+            char path[256];
+            snprintf(path, sizeof(path), "%s/%s", dir, files[f]);
+            unlink(path);
+        }
+        rmdir(dir);
+        if (status != 0) {
+            fprintf(stderr, "Benchmark failed for %zu flights\n", size);
+            return 1;
+        }
+    }
+    return 0;
+}
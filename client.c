@@ -2,114 +2,437 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <errno.h>
 #include <libgen.h>
-#include <sys/select.h>
 #include <time.h>
+#include <pthread.h>
+#include <getopt.h>
 
-#define PORT 8080
-#define BUFFER_SIZE 1024
-#define MAX_DATAGRAM_SIZE 512
-#define UDP_TIMEOUT_SEC 1
-#define UDP_MAX_RETRIES 3
+#include "client_lib.h"
 
-typedef enum { PROTO_TCP, PROTO_UDP } Protocol;
+#define BENCH_MAX_AGENCIES 4096
+#define HIST_SUB_BUCKETS 16          // Histogram precision: 16 buckets per power of two (~6%)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 40)
 
-// UDP message header
+// ===== Load generator: ./client bench <tcp|udp> [options] =====
+
+typedef enum { BENCH_LIST, BENCH_RESERVER, BENCH_ANNULER, BENCH_FACTURE, BENCH_NB_OPS } BenchOp;
+const char *bench_op_names[BENCH_NB_OPS] = { "LIST", "RESERVER", "ANNULER", "FACTURE" };
+
+// Latency histogram in microseconds, log-linear buckets
 typedef struct {
-    uint32_t seq; // Sequence number
-    char type[5]; // Message type (e.g., LIST, WAIT) + null terminator
-    uint32_t len; // Payload length
-} UdpHeader;
-
-int create_socket(Protocol proto) {
-    int sockfd = socket(AF_INET, proto == PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Failed to create socket");
-        return -1;
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    Histogram hist[BENCH_NB_OPS];
+    uint64_t rejected[BENCH_NB_OPS]; // Error replies, e.g. no seats left
+    uint64_t errors[BENCH_NB_OPS];   // Timeouts and connection failures
+    FlightClient *client;
+    int closed;                      // A request completed with FC_CLOSED
+} BenchAgency;
+
+struct {
+    Protocol proto;
+    const char *host;
+    int agencies;
+    int depth;                       // Outstanding requests per agency in closed loop
+    int duration;
+    double rate;                     // Requests per second over all agencies, 0 for closed loop
+    int mix[BENCH_NB_OPS];
+    int mix_total;
+    int *refs;
+    int nb_refs;
+    struct timespec deadline;
+} bench;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return (int)v;
     }
-    return sockfd;
+    int msb = 63 - __builtin_clzll(v);
+    int idx = (msb - 3) * HIST_SUB_BUCKETS + (int)((v >> (msb - 4)) & (HIST_SUB_BUCKETS - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
 }
 
-int send_udp_request(int sockfd, struct sockaddr_in *serv_addr, char *buffer, size_t len, char *response, size_t resp_size) {
-    static uint32_t seq = 0;
-    UdpHeader header = { seq++, "", (uint32_t)len };
-    strncpy(header.type, strncmp(buffer, "LIST", 4) == 0 ? "LIST" : 
-                        strncmp(buffer, "RESERVER", 8) == 0 ? "RSRV" : 
-                        strncmp(buffer, "ANNULER", 7) == 0 ? "ANUL" : 
-                        strncmp(buffer, "FACTURE", 7) == 0 ? "FACT" : "UNKN", 5);
-
-    char packet[MAX_DATAGRAM_SIZE];
-    memcpy(packet, &header, sizeof(UdpHeader));
-    memcpy(packet + sizeof(UdpHeader), buffer, len);
-    size_t packet_len = sizeof(UdpHeader) + len;
-
-    struct timeval tv = { UDP_TIMEOUT_SEC, 0 };
-    int retries = 0;
-    ssize_t n;
-
-    while (retries < UDP_MAX_RETRIES) {
-        if (sendto(sockfd, packet, packet_len, 0, (struct sockaddr *)serv_addr, sizeof(*serv_addr)) < 0) {
-            perror("Failed to send UDP packet");
-            return -1;
+// Smallest value that falls in bucket idx
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx;
+    }
+    int msb = idx / HIST_SUB_BUCKETS + 3;
+    return ((uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS)) << (msb - 4);
+}
+
+void hist_record(Histogram *h, uint64_t us) {
+    h->counts[hist_index(us)]++;
+    h->total++;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t hist_percentile(const Histogram *h, double p) {
+    uint64_t target = (uint64_t)(h->total * p / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > target) {
+            return hist_value(i);
         }
+    }
+    return h->max;
+}
 
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        int ready = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        if (ready < 0) {
-            perror("Error in select");
-            return -1;
+// One request in flight, freed by its completion callback
+typedef struct {
+    BenchAgency *ag;
+    BenchOp op;
+    uint64_t start;
+} BenchRequest;
+
+void bench_done(const FlightReply *reply, void *arg) {
+    BenchRequest *r = arg;
+    BenchAgency *ag = r->ag;
+    if (reply->status == FC_TIMEOUT || reply->status == FC_CLOSED) {
+        ag->errors[r->op]++;
+        ag->closed |= reply->status == FC_CLOSED;
+    } else {
+        hist_record(&ag->hist[r->op], now_us() - r->start);
+        if (reply->status == FC_ERROR) {
+            ag->rejected[r->op]++;
         }
-        if (ready == 0) {
-            retries++;
-            printf("Timeout, retry %d/%d\n", retries, UDP_MAX_RETRIES);
-            continue;
+    }
+    free(r);
+}
+
+int bench_submit(BenchAgency *ag, const char *agence, unsigned int *rnd, uint64_t start) {
+    int pick = rand_r(rnd) % bench.mix_total;
+    BenchOp op = BENCH_LIST;
+    while (pick >= bench.mix[op]) {
+        pick -= bench.mix[op];
+        op++;
+    }
+    int ref = bench.refs[rand_r(rnd) % bench.nb_refs];
+    BenchRequest *r = malloc(sizeof(BenchRequest));
+    if (!r) {
+        ag->errors[op]++;
+        return -1;
+    }
+    r->ag = ag;
+    r->op = op;
+    r->start = start;
+    int rc;
+    switch (op) {
+        case BENCH_LIST:     rc = fc_list(ag->client, bench_done, r); break;
+        case BENCH_RESERVER: rc = fc_reserver(ag->client, ref, 1, agence, bench_done, r); break;
+        case BENCH_ANNULER:  rc = fc_annuler(ag->client, ref, 1, agence, bench_done, r); break;
+        default:             rc = fc_facture(ag->client, agence, bench_done, r); break;
+    }
+    if (rc < 0) {
+        ag->errors[op]++;
+        free(r);
+    }
+    return rc;
+}
+
+void *bench_agency_thread(void *arg) {
+    BenchAgency *ag = arg;
+    char agence[50];
+    snprintf(agence, sizeof(agence), "bench%d", ag->id);
+    unsigned int rnd = (unsigned int)(ag->id * 7919 + now_us());
+    ag->client = fc_open(bench.host, PORT, bench.proto, 1);
+
+    uint64_t deadline = (uint64_t)bench.deadline.tv_sec * 1000000 + bench.deadline.tv_nsec / 1000;
+    uint64_t interval = bench.rate > 0 ? (uint64_t)(1e6 * bench.agencies / bench.rate) : 0;
+    uint64_t next = now_us() + (interval ? rand_r(&rnd) % interval : 0);
+    while (1) {
+        uint64_t now = now_us();
+        if (ag->closed || !ag->client) {
+            // The connection failed: its requests were counted as errors, start a new one
+            if (ag->client) {
+                fc_close(ag->client);
+            }
+            ag->closed = 0;
+            if (!(ag->client = fc_open(bench.host, PORT, bench.proto, 1))) {
+                usleep(10000);
+                if (now_us() >= deadline) {
+                    break;
+                }
+                continue;
+            }
         }
+        if (interval) {
+            // Open loop: latency is measured from the scheduled time, so a slow server is not hidden
+            while (next <= now && next < deadline) {
+                bench_submit(ag, agence, &rnd, next);
+                next += interval;
+            }
+            if (next >= deadline) {
+                break;
+            }
+            uint64_t wait_ms = (next - now) / 1000;
+            fc_poll(ag->client, wait_ms < 100 ? (int)wait_ms : 100);
+        } else {
+            // Closed loop: keep bench.depth requests outstanding
+            if (now >= deadline) {
+                break;
+            }
+            while (fc_pending(ag->client) < bench.depth && bench_submit(ag, agence, &rnd, now_us()) == 0) {
+            }
+            fc_poll(ag->client, 100);
+        }
+    }
+    // Wait for the replies still in flight, the UDP timers bound this
+    while (ag->client && !ag->closed && fc_pending(ag->client) > 0) {
+        fc_poll(ag->client, 100);
+    }
+    if (ag->client) {
+        fc_close(ag->client);
+    }
+    return NULL;
+}
 
-        struct sockaddr_in from_addr;
-        socklen_t from_len = sizeof(from_addr);
-        n = recvfrom(sockfd, packet, MAX_DATAGRAM_SIZE, 0, (struct sockaddr *)&from_addr, &from_len);
-        if (n < 0) {
-            perror("Failed to receive UDP packet");
-            return -1;
+// Read the flight references from a LIST so bookings target existing flights
+int bench_fetch_refs(void) {
+    FlightClient *c = fc_open(bench.host, PORT, bench.proto, 1);
+    if (!c) {
+        return -1;
+    }
+    char *text;
+    size_t len;
+    FlightStatus status = fc_call(c, "LIST", &text, &len);
+    fc_close(c);
+    if (status != FC_OK || !text) {
+        fprintf(stderr, "Failed to fetch the flight list\n");
+        free(text);
+        return -1;
+    }
+
+    int cap_refs = 64;
+    bench.refs = malloc(cap_refs * sizeof(int));
+    for (char *line = strtok(text, "\n"); line && bench.refs; line = strtok(NULL, "\n")) {
+        int ref, places, prix;
+        char dest[50];
+        if (sscanf(line, "%d %49s %d %d", &ref, dest, &places, &prix) == 4) {
+            if (bench.nb_refs == cap_refs) {
+                bench.refs = realloc(bench.refs, (cap_refs *= 2) * sizeof(int));
+                if (!bench.refs) {
+                    break;
+                }
+            }
+            bench.refs[bench.nb_refs++] = ref;
         }
+    }
+    free(text);
+    if (bench.nb_refs == 0) {
+        fprintf(stderr, "No flights found in LIST reply\n");
+        return -1;
+    }
+    return 0;
+}
 
-        if (n < sizeof(UdpHeader)) {
-            printf("Received datagram too short\n");
-            continue;
+void bench_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s bench <tcp|udp> [-c agencies] [-d seconds] [-r requests_per_sec] "
+                    "[-p pipeline_depth] [-m list,reserver,annuler,facture] [-H server_ip]\n", prog);
+}
+
+int run_bench(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    if (argc < 3 || (strcmp(argv[2], "tcp") != 0 && strcmp(argv[2], "udp") != 0)) {
+        bench_usage(prog);
+        return 1;
+    }
+    bench.proto = strcmp(argv[2], "tcp") == 0 ? PROTO_TCP : PROTO_UDP;
+    bench.agencies = 8;
+    bench.duration = 10;
+    int mix[BENCH_NB_OPS] = { 10, 40, 40, 10 };
+    memcpy(bench.mix, mix, sizeof(mix));
+    bench.host = "127.0.0.1";
+    bench.depth = 1;
+
+    int opt;
+    optind = 3;
+    while ((opt = getopt(argc, argv, "c:d:r:p:m:H:")) != -1) {
+        switch (opt) {
+            case 'c': bench.agencies = atoi(optarg); break;
+            case 'd': bench.duration = atoi(optarg); break;
+            case 'r': bench.rate = atof(optarg); break;
+            case 'p': bench.depth = atoi(optarg); break;
+            case 'H': bench.host = optarg; break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d,%d", &bench.mix[0], &bench.mix[1], &bench.mix[2], &bench.mix[3]) != 4) {
+                    bench_usage(prog);
+                    return 1;
+                }
+                break;
+            default:
+                bench_usage(prog);
+                return 1;
         }
+    }
+    bench.mix_total = 0;
+    for (int i = 0; i < BENCH_NB_OPS; i++) {
+        bench.mix_total += bench.mix[i] > 0 ? bench.mix[i] : (bench.mix[i] = 0);
+    }
+    if (bench.agencies < 1 || bench.agencies > BENCH_MAX_AGENCIES || bench.duration < 1 || bench.mix_total == 0 ||
+        bench.depth < 1 || bench.depth > FC_MAX_PENDING) {
+        bench_usage(prog);
+        return 1;
+    }
 
-        UdpHeader recv_header;
-        memcpy(&recv_header, packet, sizeof(UdpHeader));
-        if (recv_header.seq != header.seq) {
-            printf("Incorrect sequence number, ignoring\n");
+    if (bench_fetch_refs() < 0) {
+        return 1;
+    }
+
+    BenchAgency *agencies = calloc(bench.agencies, sizeof(BenchAgency));
+    if (!agencies) {
+        perror("Failed to allocate agencies");
+        return 1;
+    }
+    char loop[32];
+    snprintf(loop, sizeof(loop), bench.rate > 0 ? "open loop" : "closed loop, depth %d", bench.depth);
+    printf("Benchmark: %d agencies over %s, %s, %d s, %d flights, mix LIST/RESERVER/ANNULER/FACTURE %d/%d/%d/%d\n",
+           bench.agencies, argv[2], loop, bench.duration, bench.nb_refs,
+           bench.mix[0], bench.mix[1], bench.mix[2], bench.mix[3]);
+    clock_gettime(CLOCK_MONOTONIC, &bench.deadline);
+    bench.deadline.tv_sec += bench.duration;
+    uint64_t started = now_us();
+    for (int i = 0; i < bench.agencies; i++) {
+        agencies[i].id = i;
+        if (pthread_create(&agencies[i].thread, NULL, bench_agency_thread, &agencies[i]) != 0) {
+            perror("Failed to create agency thread");
+            return 1;
+        }
+    }
+    for (int i = 0; i < bench.agencies; i++) {
+        pthread_join(agencies[i].thread, NULL);
+    }
+    double elapsed = (now_us() - started) / 1e6;
+
+    printf("%-9s %10s %9s %7s %10s %9s %9s %9s %9s\n", "op", "count", "rejected", "errors", "req/s",
+           "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    Histogram all = {0};
+    uint64_t all_rejected = 0, all_errors = 0;
+    for (int op = 0; op <= BENCH_NB_OPS; op++) {
+        Histogram merged = {0};
+        uint64_t rejected = 0, errors = 0;
+        if (op < BENCH_NB_OPS) {
+            for (int i = 0; i < bench.agencies; i++) {
+                hist_merge(&merged, &agencies[i].hist[op]);
+                rejected += agencies[i].rejected[op];
+                errors += agencies[i].errors[op];
+            }
+            hist_merge(&all, &merged);
+            all_rejected += rejected;
+            all_errors += errors;
+        } else {
+            merged = all;
+            rejected = all_rejected;
+            errors = all_errors;
+        }
+        if (merged.total == 0 && errors == 0) {
             continue;
         }
+        printf("%-9s %10llu %9llu %7llu %10.0f %9llu %9llu %9llu %9llu\n",
+               op < BENCH_NB_OPS ? bench_op_names[op] : "TOTAL",
+               (unsigned long long)merged.total, (unsigned long long)rejected, (unsigned long long)errors,
+               merged.total / elapsed,
+               (unsigned long long)hist_percentile(&merged, 50), (unsigned long long)hist_percentile(&merged, 99),
+               (unsigned long long)hist_percentile(&merged, 99.9), (unsigned long long)merged.max);
+    }
+    free(agencies);
+    free(bench.refs);
+    return 0;
+}
 
-        size_t payload_len = n - sizeof(UdpHeader);
-        if (payload_len > resp_size - 1) {
-            payload_len = resp_size - 1;
+#define MENU_PAGE_SIZE 20
+
+// Print the flight list one page at a time, the user stops when they have seen enough.
+// Returns -1 when the server does not answer over UDP.
+int run_pages(FlightClient *client) {
+    char cursor[32] = "-", command[64];
+    printf("\nAvailable Flights:\n");
+    for (int page = 0; ; page++) {
+        char *reply;
+        size_t len;
+        snprintf(command, sizeof(command), "PAGE %s %d", cursor, MENU_PAGE_SIZE);
+        FlightStatus status = fc_call(client, command, &reply, &len);
+        if (status != FC_OK || !reply) {
+            printf("%s", reply ? reply : "Failed to fetch the flight list\n");
+            free(reply);
+            return status == FC_TIMEOUT ? -1 : 0;
         }
-        memcpy(response, packet + sizeof(UdpHeader), payload_len);
-        response[payload_len] = '\0';
-
-        if (strncmp(recv_header.type, "WAIT", 4) == 0) {
-            printf("%s\n", response);
-            continue; // Wait for next packet
+        // The titles line is repeated on every page, print it once
+        char *lines = reply;
+        if (page > 0 && (lines = strchr(reply, '\n'))) {
+            lines++;
+        }
+        char *next = strstr(lines, "\nNEXT ");
+        if (!next) {
+            printf("%s", lines);
+            free(reply);
+            return 0;
+        }
+        sscanf(next + 6, "%31s", cursor);
+        printf("%.*s", (int)(next + 1 - lines), lines);
+        free(reply);
+        printf("-- Entrée pour la suite, q pour revenir au menu -- ");
+        int c = getchar();
+        if (c != '\n') {
+            while (c != EOF && getchar() != '\n');
+        }
+        if (c == 'q' || c == EOF) {
+            return 0;
         }
-
-        return payload_len;
     }
+}
 
-    printf("Failed after %d retries\n", UDP_MAX_RETRIES);
-    return -1;
+// Run one command and print its reply. Returns -1 when the server does not answer over UDP.
+// Over TCP the library already reconnected and retried, and tries again with the next command.
+int run_command(FlightClient *client, const char *command, const char *title) {
+    char *reply;
+    size_t len;
+    FlightStatus status = fc_call(client, command, &reply, &len);
+    if (status == FC_ERROR && !reply) {
+        printf("Invalid request\n");
+    } else if (status == FC_TIMEOUT) {
+        printf("Failed after %d retries\n", UDP_MAX_RETRIES);
+    } else if (status == FC_CLOSED) {
+        printf("Server unreachable: the request may or may not have been executed, check the invoice before booking again\n");
+    } else if (title) {
+        printf("\n%s\n%s", title, reply ? reply : "");
+    } else {
+        printf("\nResponse:\n%s\n", reply ? reply : "");
+    }
+    free(reply);
+    return status == FC_TIMEOUT ? -1 : 0;
 }
 
 int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return run_bench(argc, argv);
+    }
+
     Protocol proto = PROTO_TCP;
     if (argc > 1) {
         if (strcmp(argv[1], "tcp") == 0) {
@@ -122,8 +445,6 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    int sockfd = -1;
-    struct sockaddr_in serv_addr;
     char buffer[BUFFER_SIZE];
     char agence[50];
 
@@ -136,31 +457,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Create socket
-    sockfd = create_socket(proto);
-    if (sockfd < 0) {
+    FlightClient *client = fc_open("127.0.0.1", PORT, proto, 1);
+    if (!client) {
         return 1;
     }
 
-    // Configure server address
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("Invalid server IP address");
-        close(sockfd);
-        return 1;
-    }
-
-    // Connect for TCP
-    if (proto == PROTO_TCP) {
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-            perror("Failed to connect to server");
-            close(sockfd);
-            return 1;
-        }
-    }
-
     int choix;
     while (1) {
         printf("\n===== Menu de Réservation de Vol =====\n");
@@ -168,6 +469,9 @@ int main(int argc, char *argv[]) {
         printf("2. Réserver un vol\n");
         printf("3. Annuler une reservation\n");
         printf("4. Consulter Facture\n");
+        printf("5. Statistiques du serveur\n");
+        printf("6. Réserver un itinéraire (vols avec correspondance)\n");
+        printf("7. Rechercher des vols\n");
         printf("0. Exit\n");
         printf("Entrer votre choix: ");
         if (scanf("%d", &choix) != 1) {
@@ -183,180 +487,81 @@ int main(int argc, char *argv[]) {
         }
 
         memset(buffer, 0, BUFFER_SIZE);
+        const char *title = NULL; // STATS and SEARCH replies are printed as is, they end with END
 
         switch (choix) {
-            case 1: {
-    strncpy(buffer, "LIST", 5);
-    size_t len = strlen(buffer);
-    if (proto == PROTO_TCP) {
-        // TCP handling remains unchanged
-        if (write(sockfd, buffer, len) != len) {
-            perror("Failed to send LIST command");
-            close(sockfd);
-            return 1;
-        }
-        printf("\nAvailable Flights:\n");
-        while (1) {
-            ssize_t n = read(sockfd, buffer, BUFFER_SIZE - 1);
-            if (n < 0) {
-                perror("Error reading LIST response");
-                close(sockfd);
-                return 1;
-            }
-            if (n == 0) {
-                printf("Server closed connection\n");
-                close(sockfd);
-                return 1;
-            }
-            buffer[n] = '\0';
-            if (strncmp(buffer, "WAIT", 4) == 0) {
-                printf("%s\n", buffer + 5);
+            case 1:
+                if (run_pages(client) < 0) {
+                    fc_close(client);
+                    return 1;
+                }
                 continue;
-            }
-            printf("%s", buffer);
-            if (strstr(buffer, "END\n") != NULL) {
+
+            case 5:
+                snprintf(buffer, BUFFER_SIZE, "STATS");
+                title = "Server statistics:";
                 break;
-            }
-        }
-    } else { // UDP
-        printf("\nVols disponibles\n");
-        // Send a single LIST request
-        ssize_t n = send_udp_request(sockfd, &serv_addr, buffer, len, buffer, BUFFER_SIZE);
-        if (n < 0) {
-            close(sockfd);
-            return 1;
-        }
-        // Keep receiving responses with the same seq until END
-        while (strncmp(buffer, "END", 3) != 0) {
-            printf("%s", buffer);
-            // Receive next packet without sending a new LIST request
-            struct sockaddr_in from_addr;
-            socklen_t from_len = sizeof(from_addr);
-            struct timeval tv = { UDP_TIMEOUT_SEC, 0 };
-            fd_set readfds;
-            FD_ZERO(&readfds);
-            FD_SET(sockfd, &readfds);
-            int ready = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-            if (ready < 0) {
-                perror("Error in select");
-                close(sockfd);
-                return 1;
-            }
-            if (ready == 0) {
-                printf("Timeout waiting for next LIST response\n");
-                close(sockfd);
-                return 1;
-            }
-            n = recvfrom(sockfd, buffer, MAX_DATAGRAM_SIZE, 0, (struct sockaddr *)&from_addr, &from_len);
-            if (n < 0) {
-                perror("Failed to receive UDP packet");
-                close(sockfd);
-                return 1;
-            }
-            if (n < sizeof(UdpHeader)) {
-                printf("Received datagram too short\n");
-                continue;
-            }
-            UdpHeader recv_header;
-            memcpy(&recv_header, buffer, sizeof(UdpHeader));
-            size_t payload_len = n - sizeof(UdpHeader);
-            if (payload_len > BUFFER_SIZE - 1) {
-                payload_len = BUFFER_SIZE - 1;
-            }
-            memcpy(buffer, buffer + sizeof(UdpHeader), payload_len);
-            buffer[payload_len] = '\0';
-            if (strncmp(recv_header.type, "WAIT", 4) == 0) {
-                printf("%s\n", buffer);
-                continue;
-            }
-        }
-        printf("END\n");
-    }
-    break;
-}
 
-            case 2: {
+            case 2:
+            case 3: {
                 int ref, nb;
-                printf("Entrez la référence du vol :");
+                printf(choix == 2 ? "Entrez la référence du vol :" : "Entrez la référence du vol a annuler : ");
                 if (scanf("%d", &ref) != 1 || ref < 0) {
                     printf("Invalid flight reference\n");
                     while (getchar() != '\n');
                     continue;
                 }
-                printf("Entrez le nombre de places :");
+                printf(choix == 2 ? "Entrez le nombre de places :" : "Entrez le nombre de places a annuler:");
                 if (scanf("%d", &nb) != 1 || nb <= 0) {
                     printf("Invalid number of seats\n");
                     while (getchar() != '\n');
                     continue;
                 }
                 while (getchar() != '\n');
-                snprintf(buffer, BUFFER_SIZE, "RESERVER %d %d %s", ref, nb, agence);
-                size_t len = strlen(buffer);
-                if (proto == PROTO_TCP) {
-                    if (write(sockfd, buffer, len) != len) {
-                        perror("Failed to send reservation");
-                        close(sockfd);
-                        return 1;
-                    }
-                } else { // UDP
-                    ssize_t n = send_udp_request(sockfd, &serv_addr, buffer, len, buffer, BUFFER_SIZE);
-                    if (n < 0) {
-                        close(sockfd);
-                        return 1;
-                    }
-                }
+                snprintf(buffer, BUFFER_SIZE, "%s %d %d %s", choix == 2 ? "RESERVER" : "ANNULER", ref, nb, agence);
                 break;
             }
 
-            case 3: {
-                int ref, nb;
-                printf("Entrez la référence du vol a annuler : ");
-                if (scanf("%d", &ref) != 1 || ref < 0) {
-                    printf("Invalid flight reference\n");
-                    while (getchar() != '\n');
-                    continue;
-                }
-                printf("Entrez le nombre de places a annuler:");
+            case 4:
+                snprintf(buffer, BUFFER_SIZE, "FACTURE %s", agence);
+                break;
+
+            case 6: {
+                int nb;
+                char refs[BUFFER_SIZE / 2];
+                printf("Entrez le nombre de places :");
                 if (scanf("%d", &nb) != 1 || nb <= 0) {
                     printf("Invalid number of seats\n");
                     while (getchar() != '\n');
                     continue;
                 }
                 while (getchar() != '\n');
-                snprintf(buffer, BUFFER_SIZE, "ANNULER %d %d %s", ref, nb, agence);
-                size_t len = strlen(buffer);
-                if (proto == PROTO_TCP) {
-                    if (write(sockfd, buffer, len) != len) {
-                        perror("Failed to send cancellation");
-                        close(sockfd);
-                        return 1;
-                    }
-                } else { // UDP
-                    ssize_t n = send_udp_request(sockfd, &serv_addr, buffer, len, buffer, BUFFER_SIZE);
-                    if (n < 0) {
-                        close(sockfd);
-                        return 1;
-                    }
+                printf("Entrez les références des vols, séparées par des espaces :");
+                if (!fgets(refs, sizeof(refs), stdin)) {
+                    continue;
                 }
+                refs[strcspn(refs, "\n")] = '\0';
+                snprintf(buffer, BUFFER_SIZE, "ITINERAIRE %d %s %s", nb, agence, refs);
                 break;
             }
 
-            case 4: {
-                snprintf(buffer, BUFFER_SIZE, "FACTURE %s", agence);
-                size_t len = strlen(buffer);
-                if (proto == PROTO_TCP) {
-                    if (write(sockfd, buffer, len) != len) {
-                        perror("Failed to send facture request");
-                        close(sockfd);
-                        return 1;
-                    }
-                } else { // UDP
-                    ssize_t n = send_udp_request(sockfd, &serv_addr, buffer, len, buffer, BUFFER_SIZE);
-                    if (n < 0) {
-                        close(sockfd);
-                        return 1;
-                    }
+            case 7: {
+                char dest[50];
+                int prix_min, prix_max, places;
+                printf("Destination (* pour toutes) :");
+                if (scanf("%49s", dest) != 1) {
+                    while (getchar() != '\n');
+                    continue;
+                }
+                printf("Prix minimum, prix maximum et nombre de places minimum :");
+                if (scanf("%d %d %d", &prix_min, &prix_max, &places) != 3) {
+                    printf("Invalid search\n");
+                    while (getchar() != '\n');
+                    continue;
                 }
+                while (getchar() != '\n');
+                snprintf(buffer, BUFFER_SIZE, "SEARCH %s %d %d %d", dest, prix_min, prix_max, places);
+                title = "Matching Flights:";
                 break;
             }
 
@@ -365,35 +570,13 @@ int main(int argc, char *argv[]) {
                 continue;
         }
 
-        if (choix != 1) {
-            if (proto == PROTO_TCP) {
-                while (1) {
-                    ssize_t n = read(sockfd, buffer, BUFFER_SIZE - 1);
-                    if (n < 0) {
-                        perror("Error reading response");
-                        close(sockfd);
-                        return 1;
-                    }
-                    if (n == 0) {
-                        printf("Server closed connection\n");
-                        close(sockfd);
-                        return 1;
-                    }
-                    buffer[n] = '\0';
-                    if (strncmp(buffer, "WAIT", 4) == 0) {
-                        printf("%s\n", buffer + 5);
-                        continue;
-                    }
-                    printf("\nResponse:\n%s\n", buffer);
-                    break;
-                }
-            } else { // UDP response already handled in send_udp_request
-                printf("\nResponse:\n%s\n", buffer);
-            }
+        if (run_command(client, buffer, title) < 0) {
+            fc_close(client);
+            return 1;
         }
     }
 
-    close(sockfd);
+    fc_close(client);
     printf("Connection closed\n");
     return 0;
 }
@@ -0,0 +1,927 @@
+#define _GNU_SOURCE
+#include "client_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define FC_TIMER_INTERVAL_MS 100  // Granularity of the UDP retransmission and TCP reconnect timers
+
+typedef struct FlightRequest {
+    uint32_t id;                  // Frame request id (TCP) or datagram sequence number (UDP)
+    uint8_t opcode;
+    FlightCallback cb;
+    void *arg;
+    FlightStatus status;
+    char *text;                   // Reply, assembled from numbered chunks for LIST, STATS, SEARCH and PAGE
+    size_t len;
+    size_t cap;
+    // TCP only
+    char *frame;                  // Frame written again after a reconnect, with the same request key
+    size_t frame_len;
+    uint64_t resend_ms;           // The server is still running the first copy: write the frame again then
+    // UDP only
+    char packet[MAX_DATAGRAM_SIZE]; // Datagram sent again on timeout
+    size_t packet_len;
+    uint64_t deadline_ms;
+    int attempts;
+    uint64_t list_version;        // Chunks being reassembled (LIST, STATS, SEARCH, PAGE)
+    uint32_t total;
+    uint32_t received;
+    char **chunks;
+    size_t *chunk_lens;
+    struct FlightRequest *prev;   // Pending list of the connection, oldest first,
+    struct FlightRequest *next;   // then list of completed requests
+} FlightRequest;
+
+typedef struct {
+    FlightClient *client;
+    int fd;
+    pthread_mutex_t lock;
+    int closed;
+    uint64_t retry_ms;            // TCP: closed, reconnect at this time with the requests still pending
+    int reconnects;               // Failed attempts since the last reply
+    uint32_t next_id;
+    FlightRequest *slots[FC_MAX_PENDING]; // Pending requests by id % FC_MAX_PENDING
+    FlightRequest *head;
+    FlightRequest *tail;
+    int nb_pending;
+    int want_out;                 // EPOLLOUT is armed
+    char *wbuf;                   // TCP frames not accepted by the socket yet
+    size_t wlen;
+    size_t woff;
+    size_t wcap;
+    char *rbuf;                   // TCP reply bytes not parsed yet
+    size_t rlen;
+    size_t rcap;
+} FcConn;
+
+struct FlightClient {
+    Protocol proto;
+    struct sockaddr_in addr;
+    int epfd;
+    FcConn *conns;
+    int nb_conns;
+    unsigned int next_conn;
+    uint64_t next_key;            // Request key of the next TCP booking, random start
+    int closing;                  // fc_close: no more reconnects
+    int nb_retrying;              // Connections waiting for a reconnect
+    int nb_resending;             // Requests answered WAIT, waiting to be written again
+    pthread_mutex_t poll_mutex;   // One thread at a time waits for replies
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;     // Broadcast after every poll round, wakes fc_call waiters
+};
+
+// Requests completed during one poll round, their callbacks run once the locks are released
+typedef struct {
+    FlightRequest *head;
+    FlightRequest *tail;
+} FcDone;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int text_append(FlightRequest *req, const char *buf, size_t len) {
+    if (req->len + len + 1 > req->cap) {
+        size_t cap = req->cap ? req->cap : BUFFER_SIZE;
+        while (cap < req->len + len + 1) {
+            cap *= 2;
+        }
+        char *tmp = realloc(req->text, cap);
+        if (!tmp) {
+            return -1;
+        }
+        req->text = tmp;
+        req->cap = cap;
+    }
+    memcpy(req->text + req->len, buf, len);
+    req->len += len;
+    req->text[req->len] = '\0';
+    return 0;
+}
+
+// Frames carry no error flag, error replies are recognised by their text
+static FlightStatus reply_status(const char *text) {
+    if (!text || strncmp(text, "Error", 5) == 0 || strncmp(text, "Invalid", 7) == 0 ||
+        strncmp(text, "Unknown", 7) == 0 || strncmp(text, "No invoice", 10) == 0) {
+        return FC_ERROR;
+    }
+    return FC_OK;
+}
+
+static void request_free(FlightRequest *req) {
+    for (uint32_t i = 0; req->chunks && i < req->total; i++) {
+        free(req->chunks[i]);
+    }
+    free(req->chunks);
+    free(req->chunk_lens);
+    free(req->frame);
+    free(req->text);
+    free(req);
+}
+
+// Unlink a pending request and queue it for its callback
+static void conn_complete(FcConn *conn, FlightRequest *req, FlightStatus status, FcDone *done) {
+    if (req->prev) {
+        req->prev->next = req->next;
+    } else {
+        conn->head = req->next;
+    }
+    if (req->next) {
+        req->next->prev = req->prev;
+    } else {
+        conn->tail = req->prev;
+    }
+    conn->slots[req->id & (FC_MAX_PENDING - 1)] = NULL;
+    conn->nb_pending--;
+    if (req->resend_ms) {
+        req->resend_ms = 0;
+        __atomic_fetch_sub(&conn->client->nb_resending, 1, __ATOMIC_RELAXED);
+    }
+
+    req->status = status;
+    req->next = NULL;
+    if (done->tail) {
+        done->tail->next = req;
+    } else {
+        done->head = req;
+    }
+    done->tail = req;
+}
+
+// The connection is unusable. A TCP connection with requests pending is reconnected by
+// conn_retry, up to FC_RECONNECT_ATTEMPTS times; otherwise fail everything it still owes.
+static void conn_fail(FcConn *conn, FcDone *done) {
+    FlightClient *c = conn->client;
+    if (!conn->closed) {
+        conn->closed = 1;
+        epoll_ctl(c->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (c->proto == PROTO_TCP && conn->head && !c->closing && conn->reconnects < FC_RECONNECT_ATTEMPTS) {
+        if (!conn->retry_ms) {
+            __atomic_fetch_add(&c->nb_retrying, 1, __ATOMIC_RELAXED);
+        }
+        conn->retry_ms = now_ms() + FC_RECONNECT_DELAY_MS;
+        return;
+    }
+    if (conn->retry_ms) {
+        conn->retry_ms = 0;
+        __atomic_fetch_sub(&c->nb_retrying, 1, __ATOMIC_RELAXED);
+    }
+    while (conn->head) {
+        conn_complete(conn, conn->head, FC_CLOSED, done);
+    }
+}
+
+static void run_callbacks(FcDone *done) {
+    FlightRequest *req = done->head;
+    while (req) {
+        FlightRequest *next = req->next;
+        FlightReply reply = { req->status, req->text, req->len };
+        if (req->cb) {
+            req->cb(&reply, req->arg);
+        }
+        request_free(req);
+        req = next;
+    }
+    done->head = done->tail = NULL;
+}
+
+// Write as much queued output as the socket accepts, arm EPOLLOUT for the rest
+static int conn_flush(FcConn *conn) {
+    while (conn->woff < conn->wlen) {
+        ssize_t n = send(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->woff += n;
+    }
+    if (conn->woff == conn->wlen) {
+        conn->woff = conn->wlen = 0;
+    }
+    int want_out = conn->wlen > 0;
+    if (want_out != conn->want_out) {
+        struct epoll_event ev = { EPOLLIN | (want_out ? EPOLLOUT : 0), { .ptr = conn } };
+        epoll_ctl(conn->client->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_out = want_out;
+    }
+    return 0;
+}
+
+static int conn_write(FcConn *conn, const void *buf, size_t len) {
+    if (conn->wlen + len > conn->wcap) {
+        size_t cap = conn->wcap ? conn->wcap : BUFFER_SIZE;
+        while (cap < conn->wlen + len) {
+            cap *= 2;
+        }
+        char *tmp = realloc(conn->wbuf, cap);
+        if (!tmp) {
+            return -1;
+        }
+        conn->wbuf = tmp;
+        conn->wcap = cap;
+    }
+    memcpy(conn->wbuf + conn->wlen, buf, len);
+    conn->wlen += len;
+    return 0;
+}
+
+static int conn_connect(FcConn *conn) {
+    FlightClient *c = conn->client;
+    conn->fd = socket(AF_INET, c->proto == PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    if (c->proto == PROTO_TCP && connect(conn->fd, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    struct epoll_event ev = { EPOLLIN, { .ptr = conn } };
+    epoll_ctl(c->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+    conn->closed = 0;
+    conn->want_out = 0;
+    conn->rlen = conn->wlen = conn->woff = 0; // Partial frames of the previous connection
+    return 0;
+}
+
+// Open a new TCP connection and write every pending frame again, oldest first. Bookings
+// carry a request key, so the server replays the result of those it already executed.
+static void conn_retry(FcConn *conn, FcDone *done) {
+    conn->reconnects++;
+    if (conn_connect(conn) < 0) {
+        conn_fail(conn, done);
+        return;
+    }
+    if (conn->retry_ms) {
+        conn->retry_ms = 0;
+        __atomic_fetch_sub(&conn->client->nb_retrying, 1, __ATOMIC_RELAXED);
+    }
+    for (FlightRequest *req = conn->head; req; req = req->next) {
+        if (req->resend_ms) {
+            req->resend_ms = 0;
+            __atomic_fetch_sub(&conn->client->nb_resending, 1, __ATOMIC_RELAXED);
+        }
+        if (conn_write(conn, req->frame, req->frame_len) < 0) {
+            conn_fail(conn, done);
+            return;
+        }
+    }
+    if (conn_flush(conn) < 0) {
+        conn_fail(conn, done);
+    }
+}
+
+// Write again the frames whose first copy was still running on the server when they arrived
+static void conn_resend(FcConn *conn, uint64_t now, FcDone *done) {
+    int written = 0;
+    for (FlightRequest *req = conn->head; req; req = req->next) {
+        if (req->resend_ms && now >= req->resend_ms) {
+            req->resend_ms = 0;
+            __atomic_fetch_sub(&conn->client->nb_resending, 1, __ATOMIC_RELAXED);
+            if (conn_write(conn, req->frame, req->frame_len) < 0) {
+                conn_fail(conn, done);
+                return;
+            }
+            written = 1;
+        }
+    }
+    if (written && conn_flush(conn) < 0) {
+        conn_fail(conn, done);
+    }
+}
+
+static void udp_transmit(FlightClient *c, FcConn *conn, FlightRequest *req) {
+    // A lost datagram is handled like a lost reply, by the retransmission timer
+    sendto(conn->fd, req->packet, req->packet_len, 0, (struct sockaddr *)&c->addr, sizeof(c->addr));
+    req->deadline_ms = now_ms() + UDP_TIMEOUT_SEC * 1000;
+    req->attempts++;
+}
+
+// Queue a request on the next connection with a free slot. text is the UDP payload,
+// body the TCP frame body.
+static int fc_send(FlightClient *c, uint8_t opcode, const char *text, const void *body, size_t body_len, FlightCallback cb, void *arg) {
+    static const char *udp_types[] = { "", "LIST", "RSRV", "ANUL", "FACT", "STAT", "ITIN", "SRCH", "PAGE" };
+    size_t text_len = strlen(text);
+    if (text_len > MAX_DATAGRAM_SIZE - sizeof(UdpHeader) || body_len > BUFFER_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    FlightRequest *req = calloc(1, sizeof(FlightRequest));
+    if (!req) {
+        return -1;
+    }
+    req->opcode = opcode;
+    req->cb = cb;
+    req->arg = arg;
+
+    // Bookings are keyed, so that writing them again after a reconnect cannot book twice
+    uint64_t key = 0;
+    if (c->proto == PROTO_TCP && (opcode == OP_RESERVER || opcode == OP_ANNULER || opcode == OP_ITINERAIRE)) {
+        key = __atomic_fetch_add(&c->next_key, 1, __ATOMIC_RELAXED);
+    }
+
+    unsigned int start = __atomic_fetch_add(&c->next_conn, 1, __ATOMIC_RELAXED);
+    for (int k = 0; k < c->nb_conns; k++) {
+        FcConn *conn = &c->conns[(start + k) % c->nb_conns];
+        pthread_mutex_lock(&conn->lock);
+        if (c->proto == PROTO_TCP && conn->closed && !conn->retry_ms && !c->closing) {
+            // Gave up earlier: the server may be back
+            conn->reconnects = 0;
+            if (conn_connect(conn) < 0) {
+                pthread_mutex_unlock(&conn->lock);
+                continue;
+            }
+        }
+        // A connection waiting for its reconnect still queues, its frames are written then
+        if ((conn->closed && !conn->retry_ms) || conn->slots[conn->next_id & (FC_MAX_PENDING - 1)]) {
+            pthread_mutex_unlock(&conn->lock);
+            continue;
+        }
+        req->id = conn->next_id++;
+        if (c->proto == PROTO_TCP) {
+            size_t key_len = key ? 8 : 0;
+            FrameHeader h = { htons(FRAME_MAGIC), opcode, key ? FRAME_FLAG_KEY : 0, htonl(req->id), htonl((uint32_t)(key_len + body_len)) };
+            req->frame_len = sizeof(h) + key_len + body_len;
+            if (!(req->frame = malloc(req->frame_len))) {
+                pthread_mutex_unlock(&conn->lock);
+                free(req);
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(req->frame, &h, sizeof(h));
+            if (key) {
+                uint32_t half[2] = { htonl((uint32_t)(key >> 32)), htonl((uint32_t)key) };
+                memcpy(req->frame + sizeof(h), half, 8);
+            }
+            if (body_len > 0) {
+                memcpy(req->frame + sizeof(h) + key_len, body, body_len);
+            }
+            if (!conn->closed && conn_write(conn, req->frame, req->frame_len) < 0) {
+                pthread_mutex_unlock(&conn->lock);
+                request_free(req);
+                errno = ENOMEM;
+                return -1;
+            }
+        } else {
+            UdpHeader h = { req->id, "", (uint32_t)text_len };
+            snprintf(h.type, sizeof(h.type), "%s", udp_types[opcode]);
+            memcpy(req->packet, &h, sizeof(h));
+            memcpy(req->packet + sizeof(h), text, text_len);
+            req->packet_len = sizeof(h) + text_len;
+        }
+        conn->slots[req->id & (FC_MAX_PENDING - 1)] = req;
+        req->prev = conn->tail;
+        if (conn->tail) {
+            conn->tail->next = req;
+        } else {
+            conn->head = req;
+        }
+        conn->tail = req;
+        conn->nb_pending++;
+
+        if (c->proto == PROTO_UDP) {
+            udp_transmit(c, conn, req);
+        } else if (!conn->closed && conn_flush(conn) < 0) {
+            FcDone done = { NULL, NULL };
+            conn_fail(conn, &done);
+            pthread_mutex_unlock(&conn->lock);
+            run_callbacks(&done);
+            return 0; // Retried on a new connection, or completed with FC_CLOSED
+        }
+        pthread_mutex_unlock(&conn->lock);
+        return 0;
+    }
+    free(req);
+    errno = EAGAIN;
+    return -1;
+}
+
+static void put_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static size_t agence_len(const char *agence) {
+    size_t len = strlen(agence);
+    return len < 50 ? len : 49;
+}
+
+int fc_list(FlightClient *c, FlightCallback cb, void *arg) {
+    return fc_send(c, OP_LIST, "LIST", NULL, 0, cb, arg);
+}
+
+int fc_stats(FlightClient *c, FlightCallback cb, void *arg) {
+    return fc_send(c, OP_STATS, "STATS", NULL, 0, cb, arg);
+}
+
+static int fc_booking(FlightClient *c, uint8_t opcode, int ref, int nb_places, const char *agence, FlightCallback cb, void *arg) {
+    char text[BUFFER_SIZE], body[8 + 50];
+    snprintf(text, sizeof(text), "%s %d %d %.49s", opcode == OP_RESERVER ? "RESERVER" : "ANNULER", ref, nb_places, agence);
+    put_u32(body, (uint32_t)ref);
+    put_u32(body + 4, (uint32_t)nb_places);
+    memcpy(body + 8, agence, agence_len(agence));
+    return fc_send(c, opcode, text, body, 8 + agence_len(agence), cb, arg);
+}
+
+int fc_reserver(FlightClient *c, int ref, int nb_places, const char *agence, FlightCallback cb, void *arg) {
+    return fc_booking(c, OP_RESERVER, ref, nb_places, agence, cb, arg);
+}
+
+int fc_annuler(FlightClient *c, int ref, int nb_places, const char *agence, FlightCallback cb, void *arg) {
+    return fc_booking(c, OP_ANNULER, ref, nb_places, agence, cb, arg);
+}
+
+int fc_facture(FlightClient *c, const char *agence, FlightCallback cb, void *arg) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof(text), "FACTURE %.49s", agence);
+    return fc_send(c, OP_FACTURE, text, agence, agence_len(agence), cb, arg);
+}
+
+int fc_itineraire(FlightClient *c, const int *refs, int nb_refs, int nb_places, const char *agence, FlightCallback cb, void *arg) {
+    char text[BUFFER_SIZE], body[BUFFER_SIZE];
+    if (nb_refs <= 0 || 8 + 4 * (size_t)nb_refs + 50 > sizeof(body)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int n = snprintf(text, sizeof(text), "ITINERAIRE %d %.49s", nb_places, agence);
+    put_u32(body, (uint32_t)nb_places);
+    put_u32(body + 4, (uint32_t)nb_refs);
+    for (int i = 0; i < nb_refs; i++) {
+        n += snprintf(text + n, sizeof(text) - n, " %d", refs[i]);
+        put_u32(body + 8 + 4 * i, (uint32_t)refs[i]);
+    }
+    memcpy(body + 8 + 4 * nb_refs, agence, agence_len(agence));
+    return fc_send(c, OP_ITINERAIRE, text, body, 8 + 4 * nb_refs + agence_len(agence), cb, arg);
+}
+
+int fc_search(FlightClient *c, const char *dest, int prix_min, int prix_max, int places_min, FlightCallback cb, void *arg) {
+    char text[BUFFER_SIZE], body[12 + 50];
+    snprintf(text, sizeof(text), "SEARCH %.49s %d %d %d", dest ? dest : "*", prix_min, prix_max, places_min);
+    put_u32(body, (uint32_t)prix_min);
+    put_u32(body + 4, (uint32_t)prix_max);
+    put_u32(body + 8, (uint32_t)places_min);
+    size_t dest_len = dest ? agence_len(dest) : 0;
+    if (dest_len > 0) {
+        memcpy(body + 12, dest, dest_len);
+    }
+    return fc_send(c, OP_SEARCH, text, body, 12 + dest_len, cb, arg);
+}
+
+int fc_page(FlightClient *c, const char *cursor, int size, FlightCallback cb, void *arg) {
+    char text[BUFFER_SIZE], body[4 + 32];
+    size_t cursor_len = cursor ? strlen(cursor) : 0;
+    if (cursor_len >= sizeof(body) - 4) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(text, sizeof(text), "PAGE %s %d", cursor ? cursor : "-", size);
+    put_u32(body, (uint32_t)size);
+    if (cursor_len > 0) {
+        memcpy(body + 4, cursor, cursor_len);
+    }
+    return fc_send(c, OP_PAGE, text, body, 4 + cursor_len, cb, arg);
+}
+
+int fc_submit(FlightClient *c, const char *command, FlightCallback cb, void *arg) {
+    int ref, nb, used;
+    char agence[50];
+    if (strncmp(command, "LIST", 4) == 0) {
+        return fc_list(c, cb, arg);
+    } else if (strncmp(command, "STATS", 5) == 0) {
+        return fc_stats(c, cb, arg);
+    } else if (strncmp(command, "PAGE", 4) == 0) {
+        char cursor[32] = "-";
+        int size = 0;
+        sscanf(command + 4, "%31s %d", cursor, &size);
+        return fc_page(c, strcmp(cursor, "-") == 0 ? NULL : cursor, size, cb, arg);
+    } else if (sscanf(command, "SEARCH %49s%n", agence, &used) == 1) {
+        int prix_min = 0, prix_max = INT_MAX, places_min = 0;
+        sscanf(command + used, "%d %d %d", &prix_min, &prix_max, &places_min);
+        return fc_search(c, strcmp(agence, "*") == 0 ? NULL : agence, prix_min, prix_max, places_min, cb, arg);
+    } else if (sscanf(command, "RESERVER %d %d %49s", &ref, &nb, agence) == 3) {
+        return fc_reserver(c, ref, nb, agence, cb, arg);
+    } else if (sscanf(command, "ANNULER %d %d %49s", &ref, &nb, agence) == 3) {
+        return fc_annuler(c, ref, nb, agence, cb, arg);
+    } else if (sscanf(command, "FACTURE %49s", agence) == 1) {
+        return fc_facture(c, agence, cb, arg);
+    } else if (sscanf(command, "ITINERAIRE %d %49s%n", &nb, agence, &used) == 2) {
+        int refs[BUFFER_SIZE / 8], nb_refs = 0, n;
+        const char *p = command + used;
+        while (nb_refs < (int)(sizeof(refs) / sizeof(refs[0])) && sscanf(p, "%d%n", &refs[nb_refs], &n) == 1) {
+            nb_refs++;
+            p += n;
+        }
+        return fc_itineraire(c, refs, nb_refs, nb, agence, cb, arg);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static void conn_read_tcp(FcConn *conn, FcDone *done) {
+    while (1) {
+        if (conn->rcap - conn->rlen < BUFFER_SIZE) {
+            size_t cap = conn->rcap ? 2 * conn->rcap : 16 * BUFFER_SIZE;
+            char *tmp = realloc(conn->rbuf, cap);
+            if (!tmp) {
+                conn_fail(conn, done);
+                return;
+            }
+            conn->rbuf = tmp;
+            conn->rcap = cap;
+        }
+        ssize_t n = recv(conn->fd, conn->rbuf + conn->rlen, conn->rcap - conn->rlen, 0);
+        if (n > 0) {
+            conn->rlen += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn_fail(conn, done);
+            return;
+        }
+        break;
+    }
+
+    size_t off = 0;
+    while (conn->rlen - off >= sizeof(FrameHeader)) {
+        FrameHeader h;
+        memcpy(&h, conn->rbuf + off, sizeof(h));
+        uint32_t len = ntohl(h.len);
+        if (ntohs(h.magic) != FRAME_MAGIC) {
+            conn_fail(conn, done);
+            return;
+        }
+        if (conn->rlen - off < sizeof(h) + len) {
+            break; // Rest of the reply is still in flight
+        }
+        uint32_t id = ntohl(h.req_id);
+        FlightRequest *req = conn->slots[id & (FC_MAX_PENDING - 1)];
+        conn->reconnects = 0; // The server answers on this connection
+        if (req && req->id == id && len >= 4 && memcmp(conn->rbuf + off + sizeof(h), "WAIT", 4) == 0) {
+            // A copy sent before a reconnect is still running: ask again for its reply
+            if (!req->resend_ms) {
+                __atomic_fetch_add(&conn->client->nb_resending, 1, __ATOMIC_RELAXED);
+            }
+            req->resend_ms = now_ms() + FC_RECONNECT_DELAY_MS;
+        } else if (req && req->id == id) {
+            if (text_append(req, conn->rbuf + off + sizeof(h), len) < 0) {
+                conn_complete(conn, req, FC_CLOSED, done);
+            } else {
+                conn_complete(conn, req, reply_status(req->text), done);
+            }
+        }
+        off += sizeof(h) + len;
+    }
+    memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+    conn->rlen -= off;
+}
+
+// Store one chunk of a LIST, STATS, SEARCH or PAGE reply, return 1 once the reply is complete
+static int list_chunk(FlightRequest *req, const char *payload, size_t len) {
+    ListChunkHeader chunk;
+    if (len < sizeof(chunk)) {
+        return 0;
+    }
+    memcpy(&chunk, payload, sizeof(chunk));
+    if (chunk.index >= chunk.total || chunk.version < req->list_version) {
+        return 0; // Corrupt, or left over from an older version of the list
+    }
+    if (chunk.version > req->list_version) {
+        // First chunk, or the list changed: start over with the new version
+        for (uint32_t i = 0; req->chunks && i < req->total; i++) {
+            free(req->chunks[i]);
+        }
+        free(req->chunks);
+        free(req->chunk_lens);
+        req->list_version = chunk.version;
+        req->total = chunk.total;
+        req->received = 0;
+        req->chunks = calloc(chunk.total, sizeof(char *));
+        req->chunk_lens = calloc(chunk.total, sizeof(size_t));
+        if (!req->chunks || !req->chunk_lens) {
+            req->total = 0;
+            return 0;
+        }
+    }
+    if (chunk.total != req->total || req->chunks[chunk.index]) {
+        return 0; // Duplicate
+    }
+    len -= sizeof(chunk);
+    if (!(req->chunks[chunk.index] = malloc(len ? len : 1))) {
+        return 0;
+    }
+    memcpy(req->chunks[chunk.index], payload + sizeof(chunk), len);
+    req->chunk_lens[chunk.index] = len;
+    req->received++;
+    req->attempts = 0; // Progress: the server is alive
+    req->deadline_ms = now_ms() + UDP_TIMEOUT_SEC * 1000;
+    if (req->received < req->total) {
+        return 0;
+    }
+    // Same text as over TCP
+    for (uint32_t i = 0; i < req->total; i++) {
+        if (text_append(req, req->chunks[i], req->chunk_lens[i]) < 0) {
+            return 0;
+        }
+    }
+    return text_append(req, "END\n", 4) == 0;
+}
+
+static void conn_read_udp(FcConn *conn, FcDone *done) {
+    char packet[MAX_DATAGRAM_SIZE + 1];
+    while (1) {
+        ssize_t n = recv(conn->fd, packet, MAX_DATAGRAM_SIZE, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // Nothing left, or an ICMP error: the timers deal with it
+        }
+        if (n < (ssize_t)sizeof(UdpHeader)) {
+            continue;
+        }
+        UdpHeader h;
+        memcpy(&h, packet, sizeof(h));
+        FlightRequest *req = conn->slots[h.seq & (FC_MAX_PENDING - 1)];
+        if (!req || req->id != h.seq) {
+            continue; // Late reply of a request that already completed
+        }
+        const char *payload = packet + sizeof(h);
+        size_t len = n - sizeof(h);
+        if (strncmp(h.type, "WAIT", 4) == 0) {
+            req->deadline_ms = now_ms() + UDP_TIMEOUT_SEC * 1000; // Queued behind another agency
+        } else if (req->opcode == OP_LIST && strncmp(h.type, "LIST", 4) == 0) {
+            if (list_chunk(req, payload, len)) {
+                conn_complete(conn, req, FC_OK, done);
+            }
+        } else if ((req->opcode == OP_STATS && strncmp(h.type, "STAT", 4) == 0) ||
+                   (req->opcode == OP_SEARCH && strncmp(h.type, "SRCH", 4) == 0) ||
+                   (req->opcode == OP_PAGE && strncmp(h.type, "PAGE", 4) == 0)) {
+            if (list_chunk(req, payload, len)) {
+                conn_complete(conn, req, reply_status(req->text), done);
+            }
+        } else {
+            text_append(req, payload, len);
+            conn_complete(conn, req, strncmp(h.type, "ERR", 3) == 0 ? FC_ERROR : reply_status(req->text), done);
+        }
+    }
+}
+
+// Resend the UDP requests whose reply is late, give up after UDP_MAX_RETRIES attempts
+static void conn_timers(FlightClient *c, FcConn *conn, uint64_t now, FcDone *done) {
+    FlightRequest *req = conn->head;
+    while (req) {
+        FlightRequest *next = req->next;
+        if (now >= req->deadline_ms) {
+            if (req->attempts >= UDP_MAX_RETRIES) {
+                conn_complete(conn, req, FC_TIMEOUT, done);
+            } else {
+                if (req->opcode == OP_LIST && req->total > 0) {
+                    // Only ask for the missing chunks
+                    char *text = req->packet + sizeof(UdpHeader);
+                    size_t size = MAX_DATAGRAM_SIZE - sizeof(UdpHeader);
+                    int len = snprintf(text, size, "LIST %llu", (unsigned long long)req->list_version);
+                    int asked = 0;
+                    for (uint32_t i = 0; i < req->total && asked < LIST_MAX_RESEND && len < (int)size - 12; i++) {
+                        if (!req->chunks[i]) {
+                            len += snprintf(text + len, size - len, " %u", i);
+                            asked++;
+                        }
+                    }
+                    UdpHeader h = { req->id, "LIST", (uint32_t)len };
+                    memcpy(req->packet, &h, sizeof(h));
+                    req->packet_len = sizeof(h) + len;
+                }
+                // STATS, SEARCH and PAGE are asked for again: the new reply has a higher version
+                // and replaces the chunks received so far
+                udp_transmit(c, conn, req);
+            }
+        }
+        req = next;
+    }
+}
+
+int fc_poll(FlightClient *c, int timeout_ms) {
+    FcDone done = { NULL, NULL };
+    struct epoll_event events[64];
+    pthread_mutex_lock(&c->poll_mutex);
+    int tcp_timers = __atomic_load_n(&c->nb_retrying, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&c->nb_resending, __ATOMIC_RELAXED) > 0;
+    if ((c->proto == PROTO_UDP || tcp_timers) && timeout_ms > FC_TIMER_INTERVAL_MS) {
+        timeout_ms = FC_TIMER_INTERVAL_MS;
+    }
+    int n = epoll_wait(c->epfd, events, 64, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        pthread_mutex_unlock(&c->poll_mutex);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        FcConn *conn = events[i].data.ptr;
+        pthread_mutex_lock(&conn->lock);
+        if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            if (c->proto == PROTO_TCP) {
+                conn_read_tcp(conn, &done);
+            } else {
+                conn_read_udp(conn, &done);
+            }
+        }
+        if (!conn->closed && (events[i].events & EPOLLOUT) && conn_flush(conn) < 0) {
+            conn_fail(conn, &done);
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+    if (c->proto == PROTO_UDP) {
+        uint64_t now = now_ms();
+        for (int i = 0; i < c->nb_conns; i++) {
+            pthread_mutex_lock(&c->conns[i].lock);
+            conn_timers(c, &c->conns[i], now, &done);
+            pthread_mutex_unlock(&c->conns[i].lock);
+        }
+    } else if (tcp_timers) {
+        uint64_t now = now_ms();
+        for (int i = 0; i < c->nb_conns; i++) {
+            FcConn *conn = &c->conns[i];
+            pthread_mutex_lock(&conn->lock);
+            if (conn->closed && conn->retry_ms && now >= conn->retry_ms) {
+                conn_retry(conn, &done);
+            } else if (!conn->closed) {
+                conn_resend(conn, now, &done);
+            }
+            pthread_mutex_unlock(&conn->lock);
+        }
+    }
+    pthread_mutex_unlock(&c->poll_mutex);
+
+    int completed = 0;
+    for (FlightRequest *req = done.head; req; req = req->next) {
+        completed++;
+    }
+    run_callbacks(&done);
+    pthread_mutex_lock(&c->done_mutex);
+    pthread_cond_broadcast(&c->done_cond);
+    pthread_mutex_unlock(&c->done_mutex);
+    return completed;
+}
+
+int fc_pending(FlightClient *c) {
+    int pending = 0;
+    for (int i = 0; i < c->nb_conns; i++) {
+        pthread_mutex_lock(&c->conns[i].lock);
+        pending += c->conns[i].nb_pending;
+        pthread_mutex_unlock(&c->conns[i].lock);
+    }
+    return pending;
+}
+
+FlightClient *fc_open(const char *host, int port, Protocol proto, int nb_conns) {
+    FlightClient *c = calloc(1, sizeof(FlightClient));
+    if (!c || nb_conns < 1 || !(c->conns = calloc(nb_conns, sizeof(FcConn)))) {
+        free(c);
+        return NULL;
+    }
+    c->proto = proto;
+    c->nb_conns = nb_conns;
+    c->addr.sin_family = AF_INET;
+    c->addr.sin_port = htons(port);
+    pthread_mutex_init(&c->poll_mutex, NULL);
+    pthread_mutex_init(&c->done_mutex, NULL);
+    pthread_cond_init(&c->done_cond, NULL);
+    c->epfd = epoll_create1(0);
+    if (inet_pton(AF_INET, host, &c->addr.sin_addr) <= 0 || c->epfd < 0) {
+        fprintf(stderr, "Invalid server address %s\n", host);
+        if (c->epfd >= 0) {
+            close(c->epfd);
+        }
+        free(c->conns);
+        free(c);
+        return NULL;
+    }
+
+    // Random first UDP sequence number, so a restarted client never hits the server's reply cache.
+    // Request keys are shared by every client of the server: start from 64 random bits.
+    uint32_t seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    int rnd = open("/dev/urandom", O_RDONLY);
+    if (rnd < 0 || read(rnd, &c->next_key, sizeof(c->next_key)) != sizeof(c->next_key)) {
+        c->next_key = ((uint64_t)seed << 32) ^ (uint64_t)time(NULL) * 2654435761U;
+    }
+    if (rnd >= 0) {
+        close(rnd);
+    }
+    c->next_key |= 1; // Never 0 (no key) before wrapping around
+    for (int i = 0; i < nb_conns; i++) {
+        FcConn *conn = &c->conns[i];
+        conn->client = c;
+        pthread_mutex_init(&conn->lock, NULL);
+        conn->next_id = proto == PROTO_UDP ? seed * 2654435761U + i * 0x10000 : 1;
+        if (conn_connect(conn) < 0) {
+            perror("Failed to connect to server");
+            conn->closed = 1;
+            fc_close(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+void fc_close(FlightClient *c) {
+    FcDone done = { NULL, NULL };
+    c->closing = 1;
+    for (int i = 0; i < c->nb_conns; i++) {
+        FcConn *conn = &c->conns[i];
+        if (!conn->client) {
+            break; // fc_open failed before this connection
+        }
+        pthread_mutex_lock(&conn->lock);
+        if (conn->closed && conn->fd >= 0) {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+        conn_fail(conn, &done);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    run_callbacks(&done);
+    for (int i = 0; i < c->nb_conns && c->conns[i].client; i++) {
+        pthread_mutex_destroy(&c->conns[i].lock);
+        free(c->conns[i].wbuf);
+        free(c->conns[i].rbuf);
+    }
+    close(c->epfd);
+    pthread_mutex_destroy(&c->poll_mutex);
+    pthread_mutex_destroy(&c->done_mutex);
+    pthread_cond_destroy(&c->done_cond);
+    free(c->conns);
+    free(c);
+}
+
+typedef struct {
+    int done;
+    FlightStatus status;
+    char *text;
+    size_t len;
+} FcCall;
+
+static void fc_call_done(const FlightReply *reply, void *arg) {
+    FcCall *call = arg;
+    call->status = reply->status;
+    if (reply->text && (call->text = malloc(reply->len + 1))) {
+        memcpy(call->text, reply->text, reply->len + 1);
+        call->len = reply->len;
+    }
+    __atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+}
+
+FlightStatus fc_call(FlightClient *c, const char *command, char **reply, size_t *len) {
+    FcCall call = { 0, FC_CLOSED, NULL, 0 };
+    if (fc_submit(c, command, fc_call_done, &call) < 0) {
+        *reply = NULL;
+        *len = 0;
+        return errno == EINVAL || errno == EMSGSIZE ? FC_ERROR : FC_CLOSED;
+    }
+    while (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE)) {
+        if (pthread_mutex_trylock(&c->poll_mutex) == 0) {
+            pthread_mutex_unlock(&c->poll_mutex);
+            fc_poll(c, FC_TIMER_INTERVAL_MS);
+        } else {
+            // Another thread is polling and will run our callback
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10 * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&c->done_mutex);
+            if (!__atomic_load_n(&call.done, __ATOMIC_ACQUIRE)) {
+                pthread_cond_timedwait(&c->done_cond, &c->done_mutex, &ts);
+            }
+            pthread_mutex_unlock(&c->done_mutex);
+        }
+    }
+    *reply = call.text;
+    *len = call.len;
+    return call.status;
+}
@@ -0,0 +1,114 @@
+#ifndef CLIENT_LIB_H
+#define CLIENT_LIB_H
+
+// Asynchronous client library for the flight reservation server.
+//
+// A FlightClient is a pool of connections to one server, over TCP or UDP. Requests are
+// submitted without blocking and complete through a callback run by fc_poll, so many
+// requests can be outstanding on each connection. Over TCP requests are pipelined as
+// binary frames, over UDP they are matched to replies by sequence number and resent
+// after a timeout. Every function may be called from any thread; callbacks run in the
+// thread calling fc_poll, without any library lock held, and may submit new requests.
+//
+// A TCP connection that drops is reconnected and its pending requests are written again.
+// Bookings (RESERVER, ANNULER, ITINERAIRE) carry a request key, so the server returns the
+// original result of a booking it already executed instead of booking again. A booking
+// whose first copy is still running gets a WAIT reply and is written again after
+// FC_RECONNECT_DELAY_MS; the caller only sees the final reply.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PORT 8080
+#define BUFFER_SIZE 1024
+#define MAX_DATAGRAM_SIZE 512
+#define UDP_TIMEOUT_SEC 1
+#define UDP_MAX_RETRIES 3
+#define FC_MAX_PENDING 4096          // Outstanding requests per connection, power of two
+#define FC_RECONNECT_ATTEMPTS 3      // TCP reconnects without any reply before failing with FC_CLOSED
+#define FC_RECONNECT_DELAY_MS 200
+
+typedef enum { PROTO_TCP, PROTO_UDP } Protocol;
+
+// UDP message header
+typedef struct {
+    uint32_t seq; // Sequence number
+    char type[5]; // Message type (e.g., LIST, WAIT) + null terminator
+    uint32_t len; // Payload length
+} UdpHeader;
+
+// Follows the UdpHeader of every LIST datagram: the list arrives in numbered chunks
+typedef struct {
+    uint64_t version;   // Snapshot the chunk belongs to, increases with every seat change
+    uint32_t index;
+    uint32_t total;
+} ListChunkHeader;
+
+#define LIST_MAX_RESEND 64 // Missing chunk indexes asked for in one request
+
+// Binary TCP frame header, all fields in network byte order
+typedef struct __attribute__((packed)) {
+    uint16_t magic;   // FRAME_MAGIC
+    uint8_t opcode;   // FrameOpcode
+    uint8_t flags;    // FRAME_FLAG_*
+    uint32_t req_id;  // Echoed in the reply
+    uint32_t len;     // Body length
+} FrameHeader;
+
+#define FRAME_MAGIC 0xF1A5
+#define FRAME_FLAG_KEY 0x01 // The body starts with a request key (u64): a retry of the same key is not executed twice
+
+typedef enum { OP_LIST = 1, OP_RESERVER = 2, OP_ANNULER = 3, OP_FACTURE = 4, OP_STATS = 5, OP_ITINERAIRE = 6, OP_SEARCH = 7, OP_PAGE = 8 } FrameOpcode;
+
+typedef enum {
+    FC_OK,
+    FC_ERROR,    // The server answered with an error (unknown flight, no seats left...)
+    FC_TIMEOUT,  // UDP only: no reply after UDP_MAX_RETRIES retransmissions
+    FC_CLOSED    // The connection failed and could not be reopened, or the client was closed. A booking may
+                 // or may not have been executed.
+} FlightStatus;
+
+typedef struct {
+    FlightStatus status;
+    const char *text;   // Reply text as the server sent it, NUL-terminated, NULL without reply
+    size_t len;
+} FlightReply;
+
+// The reply is only valid until the callback returns
+typedef void (*FlightCallback)(const FlightReply *reply, void *arg);
+
+typedef struct FlightClient FlightClient;
+
+// Connect nb_conns sockets to host:port. Returns NULL on failure.
+FlightClient *fc_open(const char *host, int port, Protocol proto, int nb_conns);
+// Complete the outstanding requests with FC_CLOSED, then free the client
+void fc_close(FlightClient *c);
+
+// Submit a request. Return 0, or -1 with errno set (EAGAIN when FC_MAX_PENDING requests
+// are outstanding on every connection: call fc_poll and try again).
+int fc_list(FlightClient *c, FlightCallback cb, void *arg);
+int fc_reserver(FlightClient *c, int ref, int nb_places, const char *agence, FlightCallback cb, void *arg);
+int fc_annuler(FlightClient *c, int ref, int nb_places, const char *agence, FlightCallback cb, void *arg);
+int fc_facture(FlightClient *c, const char *agence, FlightCallback cb, void *arg);
+int fc_itineraire(FlightClient *c, const int *refs, int nb_refs, int nb_places, const char *agence, FlightCallback cb, void *arg);
+int fc_stats(FlightClient *c, FlightCallback cb, void *arg);
+// Flights to dest (NULL for any) priced within [prix_min, prix_max] with at least places_min seats
+int fc_search(FlightClient *c, const char *dest, int prix_min, int prix_max, int places_min, FlightCallback cb, void *arg);
+// One page of at most size flights (0: server default) from cursor (NULL: first page). The reply
+// has the LIST format; unless it is the last page, its line before END is "NEXT <cursor>".
+int fc_page(FlightClient *c, const char *cursor, int size, FlightCallback cb, void *arg);
+// Submit a text command as typed at the server ("RESERVER 1000 2 agence", "SEARCH Paris 0 800"...)
+int fc_submit(FlightClient *c, const char *command, FlightCallback cb, void *arg);
+
+// Send and receive for up to timeout_ms (0: only what is ready), run the callbacks of the
+// completed requests. Returns how many completed, or -1.
+int fc_poll(FlightClient *c, int timeout_ms);
+// Requests submitted and not completed yet
+int fc_pending(FlightClient *c);
+
+// Blocking helper: submit a text command and wait for its completion. The reply text is
+// returned in *reply (free it), the status is the return value. A command that cannot be
+// sent (malformed, too long) returns FC_ERROR with a NULL reply.
+FlightStatus fc_call(FlightClient *c, const char *command, char **reply, size_t *len);
+
+#endif
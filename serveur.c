@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,22 +6,68 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
 #define MAX_DATAGRAM_SIZE 512
+#define LISTEN_BACKLOG SOMAXCONN
+#define EPOLL_WORKERS 4              // Default size of the worker pool (env TCP_WORKERS)
+#define TCP_QUEUE_SIZE 1024          // Default bound of the ready queue, rounded to a power of two (env TCP_QUEUE_SIZE)
+#define TCP_MAX_CLIENTS 4096         // Default cap on open TCP connections (env TCP_MAX_CLIENTS)
+#define BUSY_REPLY "Error: Server busy\n"
+#define IN_PROGRESS_REPLY "WAIT Request in progress, send it again later\n" // Keyed TCP request still running
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_MAX_READS 16           // Commands handled per wakeup before yielding to other connections
+#define EPOLL_MAX_PENDING_OUTPUT (64 * 1024) // Stop reading from a client that does not read its replies
+#define UDP_BATCH 32                 // Datagrams per recvmmsg/sendmmsg call
+#define FRAME_MAGIC 0xF1A5           // First bytes of a binary TCP frame, never the start of a text command
 #define VOL_FILE "vols.txt"
+#define VOL_STORE_FILE "vols.db"
+#define VOL_STORE_MAGIC "FLTSTOR2"      // 8 bytes, no terminator
+#define VOL_STORE_HEADER_SIZE 4096
+#define VOL_DEST_SIZE 50
 #define HISTO_FILE "histo.txt"
 #define FACTURE_FILE "facture.txt"
+#define JOURNAL_FILE "journal.log"
+#define JOURNAL_SEGMENT_FILE "journal.log.1" // Records being folded into a checkpoint
+#define CHECKPOINT_INTERVAL_SEC 60
+#define CHECKPOINT_TIMEOUT_SEC 300   // A checkpoint child still running after this is killed
+#define CHECKPOINT_JOURNAL_SIZE (64 * 1024 * 1024) // Checkpoint sooner when the journal grows past this
+#define HISTO_FLUSH_SIZE (64 * 1024)
+#define HISTO_FLUSH_INTERVAL_MS 200
+#define FACTURE_BUCKETS 65536
+#define FACTURE_STRIPES 64
+#define REPLY_CACHE_SIZE 16384         // Replies kept for retried UDP requests, power of two
+#define UDP_REPLY_TTL_SEC 30           // Longer than the client's retry window
+#define TCP_KEYS 262144                // Default size of the keyed TCP reply table (env TCP_KEYS)
+#define TCP_KEY_TTL_SEC 10             // Retry horizon, well past the client library's 3 reconnects 200 ms apart
+#define TCP_KEY_REPLY_SIZE 192         // Longest booking reply kept for a key
+#define ITINERAIRE_MAX_LEGS 8        // Flights booked together by one ITINERAIRE command
+#define STATS_FILE "stats.txt"
+#define STATS_DUMP_INTERVAL_SEC 10
+#define METRIC_SUB_BUCKETS 16        // Latency histogram precision: 16 buckets per power of two (~6%)
+#define METRIC_BUCKETS (METRIC_SUB_BUCKETS * 36)
 
 typedef enum { PROTO_TCP, PROTO_UDP } Protocol;
+typedef enum { TCP_THREAD, TCP_EPOLL } TcpMode;
+typedef enum { UDP_SINGLE, UDP_MULTI } UdpMode;
 
-// Global mutexes for file access
-pthread_mutex_t vols_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Global mutexes for file access (flight seats and invoices have finer-grained locks)
 pthread_mutex_t histo_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t facture_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // UDP message header
 typedef struct {
@@ -29,22 +76,397 @@ typedef struct {
     uint32_t len; // Payload length
 } UdpHeader;
 
-// Print debug message with timestamp
-void debug_print(const char *msg, const struct sockaddr_in *cli_addr, int sockfd) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char time_str[20];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", t);
-    
+// Binary TCP frame header, all fields in network byte order. Requests and replies
+// carry the same opcode and request id, so a client can pipeline many requests.
+typedef struct __attribute__((packed)) {
+    uint16_t magic;   // FRAME_MAGIC
+    uint8_t opcode;   // FrameOpcode
+    uint8_t flags;    // FRAME_FLAG_*, echoed in the reply
+    uint32_t req_id;  // Chosen by the client, echoed in the reply
+    uint32_t len;     // Body length
+} FrameHeader;
+
+// Request bodies: LIST is empty, RESERVER/ANNULER are ref (u32) + seats (u32) + agency,
+// ITINERAIRE is seats (u32) + leg count (u32) + one ref (u32) per leg + agency, FACTURE is the agency.
+// SEARCH is min price (u32) + max price (u32) + min seats (u32) + optional destination, PAGE is
+// page size (u32) + optional cursor. Reply bodies are the text normally sent on the connection.
+typedef enum { OP_LIST = 1, OP_RESERVER = 2, OP_ANNULER = 3, OP_FACTURE = 4, OP_STATS = 5, OP_ITINERAIRE = 6, OP_SEARCH = 7, OP_PAGE = 8 } FrameOpcode;
+
+#define FRAME_MAX_BODY (BUFFER_SIZE - sizeof(FrameHeader) - 1)
+#define FRAME_FLAG_KEY 0x01 // The body starts with a request key (u64), see tcp_key_begin
+
+// Follows the UdpHeader of every LIST datagram. The list is cut in chunks of whole lines
+// that the client reassembles, asking for missing ones with "LIST <version> <index> ...".
+// STATS, SEARCH and PAGE replies are numbered the same way, see send_udp_lines.
+typedef struct {
+    uint64_t version;   // Snapshot the chunk belongs to, increases with every seat change
+    uint32_t index;
+    uint32_t total;
+} ListChunkHeader;
+
+#define LIST_MAX_RESEND 64           // Chunk indexes accepted in one retransmission request
+#define LIST_PAGE_DEFAULT 100        // Flights per PAGE reply when the client gives no size
+#define LIST_PAGE_MAX 1000
+#define LIST_CURSOR_SIZE 32
+
+// Asynchronous logger: each thread formats into its own lock-free ring buffer and a
+// background thread drains them to stdout, so request paths never block on I/O.
+// Disabled levels cost one load and one compare, the message is never formatted.
+typedef enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG } LogLevel;
+
+#define LOG_RING_SIZE 128      // Records per thread, power of two
+#define LOG_MSG_SIZE 240
+#define LOG_DRAIN_INTERVAL_MS 10
+
+typedef struct {
+    time_t when;
+    int level;
+    char text[LOG_MSG_SIZE];
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    uint32_t head;              // Next record written, only moved by the owning thread
+    uint32_t tail;              // Next record drained, only moved by the writer thread
+    uint32_t dropped;           // Records lost because the ring was full
+    int dead;                   // Owning thread exited, freed once drained
+    struct LogRing *next;
+} LogRing;
+
+int log_level = LOG_DEBUG;
+time_t log_clock = 0;           // Coarse timestamp refreshed by the writer thread
+LogRing *log_rings = NULL;
+pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the ring list, not the records
+pthread_key_t log_ring_key;
+__thread LogRing *log_ring = NULL;
+const char *log_level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+#define log_enabled(level) ((int)(level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+#define log_printf(level, cli_addr, sockfd, ...) \
+    do { if (log_enabled(level)) log_write(level, cli_addr, sockfd, __VA_ARGS__); } while (0)
+#define debug_print(msg, cli_addr, sockfd) log_printf(LOG_DEBUG, cli_addr, sockfd, "%s", msg)
+
+void log_thread_exit(void *arg) {
+    __atomic_store_n(&((LogRing *)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+__attribute__((format(printf, 4, 5)))
+void log_write(LogLevel level, const struct sockaddr_in *cli_addr, int sockfd, const char *fmt, ...) {
+    LogRing *ring = log_ring;
+    if (!ring) {
+        ring = calloc(1, sizeof(LogRing));
+        if (!ring) {
+            return;
+        }
+        pthread_setspecific(log_ring_key, ring);
+        pthread_mutex_lock(&log_rings_mutex);
+        ring->next = log_rings;
+        log_rings = ring;
+        pthread_mutex_unlock(&log_rings_mutex);
+        log_ring = ring;
+    }
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->when = __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    rec->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        n = 0;
+    } else if (n >= (int)sizeof(rec->text)) {
+        n = sizeof(rec->text) - 1;
+    }
     if (cli_addr) {
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &cli_addr->sin_addr, client_ip, INET_ADDRSTRLEN);
-        printf("[DEBUG] %s: %s (client %s:%d)\n", time_str, msg, client_ip, ntohs(cli_addr->sin_port));
+        snprintf(rec->text + n, sizeof(rec->text) - n, " (client %s:%d)", client_ip, ntohs(cli_addr->sin_port));
     } else if (sockfd >= 0) {
-        printf("[DEBUG] %s: %s (socket %d)\n", time_str, msg, sockfd);
-    } else {
-        printf("[DEBUG] %s: %s\n", time_str, msg);
+        snprintf(rec->text + n, sizeof(rec->text) - n, " (socket %d)", sockfd);
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *log_writer_thread(void *arg) {
+    (void)arg;
+    time_t last = 0;
+    char time_str[20] = "";
+    while (1) {
+        struct timespec ts = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+        __atomic_store_n(&log_clock, time(NULL), __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&log_rings_mutex);
+        LogRing **link = &log_rings;
+        while (*link) {
+            LogRing *ring = *link;
+            int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+            uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            for (uint32_t i = ring->tail; i != head; i++) {
+                LogRecord *rec = &ring->records[i & (LOG_RING_SIZE - 1)];
+                if (rec->when != last) {
+                    // Only format the date once per second
+                    struct tm t;
+                    localtime_r(&rec->when, &t);
+                    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &t);
+                    last = rec->when;
+                }
+                printf("[%s] %s: %s\n", log_level_names[rec->level], time_str, rec->text);
+            }
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+            uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+            if (dropped) {
+                printf("[WARN] %s: %u log records dropped\n", time_str, dropped);
+            }
+            if (dead) {
+                *link = ring->next;
+                free(ring);
+            } else {
+                link = &ring->next;
+            }
+        }
+        pthread_mutex_unlock(&log_rings_mutex);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// SIGUSR1 makes the log more verbose, SIGUSR2 quieter
+void log_signal_handler(int sig) {
+    int level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+    if (sig == SIGUSR1 && level < LOG_DEBUG) {
+        __atomic_store_n(&log_level, level + 1, __ATOMIC_RELAXED);
+    } else if (sig == SIGUSR2 && level > LOG_ERROR) {
+        __atomic_store_n(&log_level, level - 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Read the initial level from LOG_LEVEL (error, warn, info, debug) and start the writer
+int log_init(void) {
+    const char *env = getenv("LOG_LEVEL");
+    for (int i = LOG_ERROR; env && i <= LOG_DEBUG; i++) {
+        if (strcasecmp(env, log_level_names[i]) == 0) {
+            log_level = i;
+        }
+    }
+    log_clock = time(NULL);
+    signal(SIGUSR1, log_signal_handler);
+    signal(SIGUSR2, log_signal_handler);
+    pthread_t thread;
+    if (pthread_key_create(&log_ring_key, log_thread_exit) != 0 ||
+        pthread_create(&thread, NULL, log_writer_thread, NULL) != 0) {
+        perror("Failed to start logger");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Runtime metrics: relaxed atomic counters updated by every request, read by the STATS
+// command and dumped to STATS_FILE by a background thread
+typedef enum { METRIC_LIST, METRIC_RESERVER, METRIC_ANNULER, METRIC_FACTURE, METRIC_ITINERAIRE, METRIC_SEARCH, METRIC_PAGE, METRIC_OTHER, METRIC_NB_CMDS } MetricCmd;
+typedef enum { WAIT_VOL, WAIT_HISTO, WAIT_FACTURE, WAIT_NB_LOCKS } MetricLock;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;             // Requests answered with an error (unknown flight, no seats, bad syntax...)
+    uint64_t max_us;
+    uint64_t buckets[METRIC_BUCKETS];
+} CmdMetrics;
+
+typedef struct {
+    uint64_t contended;          // Acquisitions that found the lock taken
+    uint64_t wait_ns;
+    uint64_t max_ns;
+} LockMetrics;
+
+CmdMetrics cmd_metrics[METRIC_NB_CMDS];
+LockMetrics lock_metrics[WAIT_NB_LOCKS];
+const char *metric_cmd_names[METRIC_NB_CMDS] = { "LIST", "RESERVER", "ANNULER", "FACTURE", "ITINERAIRE", "SEARCH", "PAGE", "OTHER" };
+const char *metric_lock_names[WAIT_NB_LOCKS] = { "flight", "histo", "facture" };
+time_t metrics_started = 0;
+uint64_t metrics_udp_replays = 0; // Retransmitted UDP requests answered from the reply cache
+uint64_t metrics_tcp_busy = 0;    // TCP requests and connections turned away with BUSY_REPLY
+uint64_t metrics_tcp_replays = 0; // Keyed TCP requests answered from the reply cache
+__thread int metrics_failed = 0; // Set by the handlers when the current request gets an error reply
+
+static uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int metrics_bucket(uint64_t us) {
+    if (us < METRIC_SUB_BUCKETS) {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int idx = (msb - 3) * METRIC_SUB_BUCKETS + (int)((us >> (msb - 4)) & (METRIC_SUB_BUCKETS - 1));
+    return idx < METRIC_BUCKETS ? idx : METRIC_BUCKETS - 1;
+}
+
+// Smallest latency counted in bucket idx
+static uint64_t metrics_bucket_us(int idx) {
+    if (idx < METRIC_SUB_BUCKETS) {
+        return idx;
+    }
+    int msb = idx / METRIC_SUB_BUCKETS + 3;
+    return ((uint64_t)(METRIC_SUB_BUCKETS + idx % METRIC_SUB_BUCKETS)) << (msb - 4);
+}
+
+static void atomic_max(uint64_t *p, uint64_t v) {
+    uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(p, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+MetricCmd metrics_command(const char *cmd) {
+    if (strncmp(cmd, "LIST", 4) == 0) {
+        return METRIC_LIST;
+    } else if (strncmp(cmd, "RESERVER", 8) == 0) {
+        return METRIC_RESERVER;
+    } else if (strncmp(cmd, "ANNULER", 7) == 0) {
+        return METRIC_ANNULER;
+    } else if (strncmp(cmd, "FACTURE", 7) == 0) {
+        return METRIC_FACTURE;
+    } else if (strncmp(cmd, "ITINERAIRE", 10) == 0) {
+        return METRIC_ITINERAIRE;
+    } else if (strncmp(cmd, "SEARCH", 6) == 0) {
+        return METRIC_SEARCH;
+    } else if (strncmp(cmd, "PAGE", 4) == 0) {
+        return METRIC_PAGE;
+    }
+    return METRIC_OTHER;
+}
+
+MetricCmd metrics_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_LIST:       return METRIC_LIST;
+        case OP_RESERVER:   return METRIC_RESERVER;
+        case OP_ANNULER:    return METRIC_ANNULER;
+        case OP_FACTURE:    return METRIC_FACTURE;
+        case OP_ITINERAIRE: return METRIC_ITINERAIRE;
+        case OP_SEARCH:     return METRIC_SEARCH;
+        case OP_PAGE:       return METRIC_PAGE;
+        default:            return METRIC_OTHER;
+    }
+}
+
+// Account one request that started at start (metrics_now_ns) and clear the error flag
+void metrics_record(MetricCmd cmd, uint64_t start) {
+    CmdMetrics *m = &cmd_metrics[cmd];
+    uint64_t us = (metrics_now_ns() - start) / 1000;
+    __atomic_fetch_add(&m->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->buckets[metrics_bucket(us)], 1, __ATOMIC_RELAXED);
+    atomic_max(&m->max_us, us);
+    if (metrics_failed) {
+        __atomic_fetch_add(&m->errors, 1, __ATOMIC_RELAXED);
+        metrics_failed = 0;
+    }
+}
+
+void metrics_lock_waited(MetricLock id, uint64_t ns) {
+    LockMetrics *l = &lock_metrics[id];
+    __atomic_fetch_add(&l->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&l->wait_ns, ns, __ATOMIC_RELAXED);
+    atomic_max(&l->max_ns, ns);
+}
+
+// pthread_mutex_lock that accounts the time spent waiting when the lock is taken
+void metrics_lock(pthread_mutex_t *m, MetricLock id) {
+    if (pthread_mutex_trylock(m) == 0) {
+        return;
+    }
+    uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(m);
+    metrics_lock_waited(id, metrics_now_ns() - start);
+}
+
+static uint64_t metrics_percentile(const uint64_t *buckets, uint64_t total, double p) {
+    uint64_t target = (uint64_t)(total * p / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return metrics_bucket_us(i);
+        }
+    }
+    return 0;
+}
+
+// Render the metrics as text lines followed by "END\n", returns the length
+size_t metrics_format(char *buf, size_t size) {
+    size_t len = 0;
+    #define METRICS_APPEND(...) \
+        do { if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); } while (0)
+    METRICS_APPEND("STATS uptime %lds\n", (long)(time(NULL) - metrics_started));
+    METRICS_APPEND("cmd requests errors p50_us p99_us p999_us max_us\n");
+    for (int c = 0; c < METRIC_NB_CMDS; c++) {
+        CmdMetrics *m = &cmd_metrics[c];
+        uint64_t buckets[METRIC_BUCKETS], total = 0;
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            buckets[i] = __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+            total += buckets[i];
+        }
+        METRICS_APPEND("%s %llu %llu %llu %llu %llu %llu\n", metric_cmd_names[c],
+                       (unsigned long long)__atomic_load_n(&m->requests, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&m->errors, __ATOMIC_RELAXED),
+                       (unsigned long long)metrics_percentile(buckets, total, 50),
+                       (unsigned long long)metrics_percentile(buckets, total, 99),
+                       (unsigned long long)metrics_percentile(buckets, total, 99.9),
+                       (unsigned long long)__atomic_load_n(&m->max_us, __ATOMIC_RELAXED));
+    }
+    METRICS_APPEND("lock contended wait_us max_us\n");
+    for (int l = 0; l < WAIT_NB_LOCKS; l++) {
+        LockMetrics *m = &lock_metrics[l];
+        METRICS_APPEND("%s %llu %llu %llu\n", metric_lock_names[l],
+                       (unsigned long long)__atomic_load_n(&m->contended, __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&m->wait_ns, __ATOMIC_RELAXED) / 1000,
+                       (unsigned long long)__atomic_load_n(&m->max_ns, __ATOMIC_RELAXED) / 1000);
+    }
+    METRICS_APPEND("udp_replays %llu\n", (unsigned long long)__atomic_load_n(&metrics_udp_replays, __ATOMIC_RELAXED));
+    METRICS_APPEND("tcp_busy %llu\n", (unsigned long long)__atomic_load_n(&metrics_tcp_busy, __ATOMIC_RELAXED));
+    METRICS_APPEND("tcp_replays %llu\n", (unsigned long long)__atomic_load_n(&metrics_tcp_replays, __ATOMIC_RELAXED));
+    METRICS_APPEND("END\n");
+    #undef METRICS_APPEND
+    return len < size ? len : size - 1;
+}
+
+// Rewrite STATS_FILE every STATS_DUMP_INTERVAL_SEC, through a rename so readers never see half a dump
+void *metrics_dump_thread(void *arg) {
+    (void)arg;
+    char text[4096];
+    while (1) {
+        sleep(STATS_DUMP_INTERVAL_SEC);
+        size_t len = metrics_format(text, sizeof(text));
+        FILE *f = fopen(STATS_FILE ".tmp", "w");
+        if (!f) {
+            perror("Failed to write stats file");
+            continue;
+        }
+        fwrite(text, 1, len, f);
+        if (fclose(f) != 0 || rename(STATS_FILE ".tmp", STATS_FILE) < 0) {
+            perror("Failed to write stats file");
+        }
+    }
+    return NULL;
+}
+
+int metrics_init(void) {
+    metrics_started = time(NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_dump_thread, NULL) != 0) {
+        perror("Failed to create stats thread");
+        return -1;
     }
+    pthread_detach(thread);
+    return 0;
 }
 
 int create_socket(Protocol proto) {
@@ -63,507 +485,3018 @@ int create_socket(Protocol proto) {
     return sockfd;
 }
 
-// Send waiting message to client
+// Per-connection state of the epoll server, owned by one worker at a time (EPOLLONESHOT)
+typedef struct {
+    int fd;
+    uint32_t events;          // Events reported by the last epoll_wait
+    char rbuf[BUFFER_SIZE];   // Last command read from the client, or the start of a partial frame
+    size_t rlen;
+    char *wbuf;               // Replies not yet accepted by the socket
+    size_t wlen;
+    size_t woff;
+    size_t wcap;
+} Conn;
+
+Conn **epoll_conns = NULL;  // Indexed by socket descriptor, NULL for thread-per-connection sockets
+size_t epoll_max_fds = 0;
+
+// Write as much pending output as the non-blocking socket accepts
+int conn_flush(Conn *c) {
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        c->woff += n;
+    }
+    c->woff = c->wlen = 0;
+    return 0;
+}
+
+// Replies of the binary frames being executed on a connection, sent in one go once they are all done
+typedef struct {
+    int sock;
+    char *buf;
+    size_t len;
+    size_t cap;
+} FrameCapture;
+
+__thread FrameCapture *tcp_capture = NULL; // Set while a worker executes binary frames
+
+int capture_append(FrameCapture *cap, const void *buf, size_t len) {
+    if (cap->len + len > cap->cap) {
+        size_t size = cap->cap ? cap->cap : BUFFER_SIZE;
+        while (size < cap->len + len) {
+            size *= 2;
+        }
+        char *tmp = realloc(cap->buf, size);
+        if (!tmp) {
+            return -1;
+        }
+        cap->buf = tmp;
+        cap->cap = size;
+    }
+    memcpy(cap->buf + cap->len, buf, len);
+    cap->len += len;
+    return 0;
+}
+
+// Send a TCP reply: written directly on blocking sockets, buffered on epoll connections
+// and captured into the reply frame while a binary request runs
+ssize_t tcp_send(int sock, const void *buf, size_t len) {
+    if (tcp_capture && tcp_capture->sock == sock) {
+        if (capture_append(tcp_capture, buf, len) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return len;
+    }
+    Conn *c = (epoll_conns && sock >= 0 && (size_t)sock < epoll_max_fds) ? epoll_conns[sock] : NULL;
+    if (!c) {
+        return write(sock, buf, len);
+    }
+    if (c->wlen + len > c->wcap) {
+        size_t cap = c->wcap ? c->wcap : BUFFER_SIZE;
+        while (cap < c->wlen + len) {
+            cap *= 2;
+        }
+        char *tmp = realloc(c->wbuf, cap);
+        if (!tmp) {
+            errno = ENOMEM;
+            return -1;
+        }
+        c->wbuf = tmp;
+        c->wcap = cap;
+    }
+    memcpy(c->wbuf + c->wlen, buf, len);
+    c->wlen += len;
+    if (conn_flush(c) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// While set, journal_wait only records the highest LSN and the caller waits once for all of them
+// (pipelined frames and UDP batches: the replies are held back until that single wait returns)
+__thread int journal_defer = 0;
+__thread uint64_t journal_deferred_lsn = 0;
+
+// Defined with the journal below
+void journal_wait(uint64_t lsn);
+void journal_wait_deferred(void);
+
+// Replies queued by a multi-threaded UDP worker, sent with one sendmmsg per batch
+typedef struct {
+    int sock;
+    unsigned int count;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char packets[UDP_BATCH][MAX_DATAGRAM_SIZE];
+} UdpBatch;
+
+__thread UdpBatch *udp_out = NULL; // Set only in multi-threaded UDP workers
+
+// Bookings of the batch defer their journal wait: their confirmations only leave once durable
+void udp_flush(UdpBatch *b) {
+    journal_wait_deferred();
+    unsigned int sent = 0;
+    while (sent < b->count) {
+        int n = sendmmsg(b->sock, b->msgs + sent, b->count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to send UDP batch");
+            break;
+        }
+        sent += n;
+    }
+    b->count = 0;
+}
+
+// Reply of the request being executed, copied for the reply cache when reply_slot is set
+__thread int reply_slot = -1;
+__thread size_t reply_copy_len = 0;
+__thread char reply_copy[MAX_DATAGRAM_SIZE];
+
+// Copy the pieces of a datagram into one buffer of at least len bytes
+static void iov_gather(char *dst, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+}
+
+// Send a datagram made of several pieces without assembling it first
+ssize_t udp_sendmsg(int sock, const struct iovec *iov, int iovcnt, const struct sockaddr *addr, socklen_t addr_len) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *)addr;
+    mh.msg_namelen = addr_len;
+    mh.msg_iov = (struct iovec *)iov;
+    mh.msg_iovlen = iovcnt;
+    return sendmsg(sock, &mh, 0);
+}
+
+// Send a UDP reply: sent right away, or queued for sendmmsg when called from a batching worker.
+// The pieces are only copied when the datagram must outlive the call (batch, reply cache).
+ssize_t udp_sendv(int sock, const struct iovec *iov, int iovcnt, const struct sockaddr *addr, socklen_t addr_len) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (reply_slot >= 0 && len <= MAX_DATAGRAM_SIZE) {
+        iov_gather(reply_copy, iov, iovcnt);
+        reply_copy_len = len;
+    }
+    UdpBatch *b = udp_out;
+    if (!b || b->sock != sock || len > MAX_DATAGRAM_SIZE || addr_len > sizeof(struct sockaddr_in)) {
+        return udp_sendmsg(sock, iov, iovcnt, addr, addr_len);
+    }
+    if (b->count == UDP_BATCH) {
+        udp_flush(b);
+    }
+    unsigned int i = b->count++;
+    iov_gather(b->packets[i], iov, iovcnt);
+    memcpy(&b->addrs[i], addr, addr_len);
+    b->iovs[i].iov_base = b->packets[i];
+    b->iovs[i].iov_len = len;
+    memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = addr_len;
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    return len;
+}
+
+ssize_t udp_send(int sock, const void *buf, size_t len, const struct sockaddr *addr, socklen_t addr_len) {
+    struct iovec iov = { (void *)buf, len };
+    return udp_sendv(sock, &iov, 1, addr, addr_len);
+}
+
+// End of the datagram that starts at text[off]: as many whole lines as fit in max bytes, or
+// the first max bytes of a line too long for one datagram. The client concatenates them.
+size_t udp_chunk_end(const char *text, size_t off, size_t len, size_t max) {
+    size_t end = off;
+    while (end < len) {
+        const char *nl = memchr(text + end, '\n', len - end);
+        size_t line_end = nl ? (size_t)(nl - text) + 1 : len; // Unterminated: the rest is one line
+        if (line_end - off > max) {
+            return end > off ? end : off + max;
+        }
+        end = line_end;
+    }
+    return end;
+}
+
+// Fixed reply text with its length known at compile time, for send_reply
+#define REPLY_TEXT(s) (s), sizeof(s) - 1
+
+// Send one reply on either transport: the text as is over TCP, after a UdpHeader of the given
+// type over UDP. The header and the text go out as separate iovecs.
+int send_reply(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq, const char *type, const char *text, size_t len) {
+    if (proto == PROTO_TCP) {
+        if (reply_slot >= 0 && len <= MAX_DATAGRAM_SIZE) {
+            memcpy(reply_copy, text, len);
+            reply_copy_len = len;
+        }
+        if (tcp_send(sock, text, len) < 0) {
+            perror("Failed to send reply");
+            return -1;
+        }
+        return 0;
+    }
+    UdpHeader header = { seq, "", (uint32_t)len };
+    strncpy(header.type, type, sizeof(header.type) - 1);
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)text, len } };
+    if (udp_sendv(sock, iov, 2, (struct sockaddr *)cli_addr, cli_len) < 0) {
+        perror("Failed to send reply via UDP");
+        return -1;
+    }
+    return 0;
+}
+
+// Formatted reply, built in a buffer that each thread reuses for all its requests
+__thread char reply_buf[BUFFER_SIZE];
+
+int send_replyf(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq, const char *type, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(reply_buf, sizeof(reply_buf), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return -1;
+    }
+    return send_reply(sock, cli_addr, cli_len, proto, seq, type, reply_buf, (size_t)len < sizeof(reply_buf) ? (size_t)len : sizeof(reply_buf) - 1);
+}
+
+// Send waiting message to client (never batched, the caller is about to block)
 void send_wait_message(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *resource, Protocol proto, uint32_t seq) {
+    if (tcp_capture && tcp_capture->sock == sock) {
+        return; // Pipelined binary requests get their reply only, there is no one to notify
+    }
     char msg[BUFFER_SIZE];
     snprintf(msg, sizeof(msg), "WAIT Waiting: another client is accessing %s", resource);
     debug_print("Sending wait message", cli_addr, sock);
     if (proto == PROTO_TCP) {
-        if (write(sock, msg, strlen(msg)) < 0) {
+        if (tcp_send(sock, msg, strlen(msg)) < 0) {
             perror("Failed to send wait message");
         }
     } else {
         UdpHeader header = { seq, "WAIT", (uint32_t)strlen(msg) };
-        char packet[MAX_DATAGRAM_SIZE];
-        memcpy(packet, &header, sizeof(UdpHeader));
-        memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-        if (sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len) < 0) {
+        struct iovec iov[2] = { { &header, sizeof(header) }, { msg, strlen(msg) } };
+        if (udp_sendmsg(sock, iov, 2, (struct sockaddr *)cli_addr, cli_len) < 0) {
             perror("Failed to send wait message via UDP");
         }
     }
 }
 
-void logHisto(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, int ref, const char *agence, const char *operation, int valeur, const char *resultat, Protocol proto, uint32_t seq) {
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Logging history: ref=%d, agency=%s, op=%s, value=%d, result=%s", ref, agence, operation, valeur, resultat);
-    debug_print(debug_msg, cli_addr, sock);
-    
-    if (pthread_mutex_trylock(&histo_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "history file", proto, seq);
-        pthread_mutex_lock(&histo_mutex);
+// Replies to requests that change seats or invoices, so a retried request is answered again
+// instead of being executed twice. UDP requests are keyed by client address, port and sequence
+// number. TCP requests carry a key chosen by the client (address and port 0), so a retry on a
+// new connection finds the reply. Each transport has its own table. Slots are reused in
+// insertion order, the oldest first, skipping the PENDING ones. A request is refused only
+// when every slot is PENDING.
+typedef enum { REPLY_FREE, REPLY_PENDING, REPLY_DONE } ReplyState;
+
+typedef struct {
+    uint32_t addr;              // Client address and port, network byte order, 0 for TCP keys
+    uint16_t port;
+    uint64_t key;               // UDP sequence number or TCP request key
+    ReplyState state;           // PENDING while the first copy of the request is executing
+    time_t created;
+    int next;                   // Next slot + 1 in the same hash bucket, 0 at the end
+    uint64_t lsn;               // Journal record the reply confirms
+    size_t len;
+    char reply[];               // reply_max bytes
+} CachedReply;
+
+typedef struct {
+    char *slots;                // size entries of stride bytes, NULL until reply_cache_init
+    int *buckets;               // 2 * size chains, first slot + 1 of each, 0 when empty
+    size_t size;                // Power of two
+    size_t stride;
+    size_t reply_max;           // Longer replies are stored truncated
+    size_t head;                // Next slot to reuse
+    int ttl;
+    pthread_mutex_t mutex;
+} ReplyCache;
+
+ReplyCache udp_replies = { .ttl = UDP_REPLY_TTL_SEC, .mutex = PTHREAD_MUTEX_INITIALIZER };
+ReplyCache tcp_keys = { .ttl = TCP_KEY_TTL_SEC, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+int reply_cache_init(ReplyCache *c, size_t size, size_t reply_max) {
+    c->size = 1;
+    while (c->size < size) {
+        c->size <<= 1;
     }
-    FILE *f = fopen(HISTO_FILE, "a");
-    if (!f) {
-        perror("Failed to open history file");
-        pthread_mutex_unlock(&histo_mutex);
+    c->reply_max = reply_max;
+    c->stride = (sizeof(CachedReply) + reply_max + 7) & ~(size_t)7;
+    c->slots = calloc(c->size, c->stride);
+    c->buckets = calloc(2 * c->size, sizeof(int));
+    if (!c->slots || !c->buckets) {
+        perror("Failed to allocate reply cache");
+        return -1;
+    }
+    return 0;
+}
+
+static CachedReply *reply_at(ReplyCache *c, int slot) {
+    return (CachedReply *)(c->slots + (size_t)slot * c->stride);
+}
+
+static size_t reply_hash(ReplyCache *c, uint32_t addr, uint16_t port, uint64_t key) {
+    uint64_t h = ((uint64_t)addr << 16 | port) * 0x9E3779B97F4A7C15ULL ^ key * 2654435761U;
+    return (h ^ h >> 29) & (2 * c->size - 1);
+}
+
+// Entry for (addr, port, key) that is PENDING or younger than the TTL, or NULL.
+// Called with the cache mutex held.
+static CachedReply *reply_cache_find(ReplyCache *c, uint32_t addr, uint16_t port, uint64_t key, time_t now) {
+    for (int i = c->buckets[reply_hash(c, addr, port, key)]; i; i = reply_at(c, i - 1)->next) {
+        CachedReply *r = reply_at(c, i - 1);
+        if (r->key == key && r->addr == addr && r->port == port && (r->state == REPLY_PENDING || now - r->created < c->ttl)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Reserve the oldest slot that is not PENDING for a request about to run and point reply_slot
+// at it. Returns -1 when every slot is PENDING. Called with the cache mutex held.
+static int reply_cache_insert(ReplyCache *c, uint32_t addr, uint16_t port, uint64_t key, time_t now) {
+    int slot = -1;
+    CachedReply *r = NULL;
+    for (size_t i = 0; i < c->size && slot < 0; i++) {
+        r = reply_at(c, (int)c->head);
+        if (r->state != REPLY_PENDING) {
+            slot = (int)c->head;
+        }
+        c->head = (c->head + 1) & (c->size - 1);
+    }
+    if (slot < 0) {
+        return -1;
+    }
+    if (r->state != REPLY_FREE) {
+        int *link = &c->buckets[reply_hash(c, r->addr, r->port, r->key)];
+        while (*link != slot + 1) {
+            link = &reply_at(c, *link - 1)->next;
+        }
+        *link = r->next;
+    }
+    size_t bucket = reply_hash(c, addr, port, key);
+    r->addr = addr;
+    r->port = port;
+    r->key = key;
+    r->state = REPLY_PENDING;
+    r->created = now;
+    r->lsn = 0;
+    r->len = 0;
+    r->next = c->buckets[bucket];
+    c->buckets[bucket] = slot + 1;
+
+    reply_slot = slot;
+    reply_copy_len = 0;
+    return 0;
+}
+
+// Store the reply sent since the request was inserted. PENDING slots are never reused, so
+// the slot still belongs to the request.
+static void reply_cache_complete(ReplyCache *c, uint64_t lsn) {
+    int slot = reply_slot;
+    if (slot < 0) {
         return;
     }
-    fprintf(f, "%d %s %s %d %s\n", ref, agence, operation, valeur, resultat);
-    fclose(f);
-    debug_print("History logged successfully", cli_addr, sock);
-    pthread_mutex_unlock(&histo_mutex);
+    reply_slot = -1;
+    pthread_mutex_lock(&c->mutex);
+    CachedReply *r = reply_at(c, slot);
+    r->len = reply_copy_len < c->reply_max ? reply_copy_len : c->reply_max;
+    memcpy(r->reply, reply_copy, r->len);
+    r->lsn = lsn;
+    r->state = REPLY_DONE;
+    pthread_mutex_unlock(&c->mutex);
 }
 
-void updateFacture(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *agence, int montant, Protocol proto, uint32_t seq) {
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Updating invoice for agency %s, amount=%d", agence, montant);
-    debug_print(debug_msg, cli_addr, sock);
-    
-    if (pthread_mutex_trylock(&facture_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "invoice file", proto, seq);
-        pthread_mutex_lock(&facture_mutex);
+// Call before executing a state-changing UDP request. Returns 1 if it is a retransmission:
+// the cached reply has been sent again, or the first copy is still running and will answer.
+// Also returns 1 after a busy error when no slot is free. Otherwise reserves a slot that
+// udp_reply_end fills with the reply.
+int udp_reply_begin(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, uint32_t seq) {
+    uint32_t addr = cli_addr->sin_addr.s_addr;
+    uint16_t port = cli_addr->sin_port;
+    time_t now = time(NULL);
+    char packet[MAX_DATAGRAM_SIZE];
+    size_t len = 0;
+
+    uint64_t lsn = 0;
+
+    if (!udp_replies.slots) {
+        return 0;
+    }
+    pthread_mutex_lock(&udp_replies.mutex);
+    CachedReply *r = reply_cache_find(&udp_replies, addr, port, seq, now);
+    if (r) {
+        if (r->state == REPLY_DONE) {
+            len = r->len;
+            lsn = r->lsn;
+            memcpy(packet, r->reply, len);
+        }
+        pthread_mutex_unlock(&udp_replies.mutex);
+        __atomic_fetch_add(&metrics_udp_replays, 1, __ATOMIC_RELAXED);
+        log_printf(LOG_DEBUG, cli_addr, sock, "Retransmitted request seq=%u %s", seq, len ? "answered from cache" : "still running");
+        if (len) {
+            journal_wait(lsn); // The first copy may still be in another worker's unsynced batch
+            udp_send(sock, packet, len, (struct sockaddr *)cli_addr, cli_len);
+        }
+        return 1;
     }
-    FILE *f = fopen(FACTURE_FILE, "r");
-    FILE *tmp = fopen("temp_facture.txt", "w");
+    int full = reply_cache_insert(&udp_replies, addr, port, seq, now) < 0;
+    pthread_mutex_unlock(&udp_replies.mutex);
+    if (full) {
+        log_printf(LOG_WARN, cli_addr, sock, "Reply cache full, refused request seq=%u", seq);
+        send_reply(sock, cli_addr, cli_len, PROTO_UDP, seq, "ERR", REPLY_TEXT(BUSY_REPLY));
+        return 1;
+    }
+    return 0;
+}
+
+void udp_reply_end(void) {
+    reply_cache_complete(&udp_replies, journal_defer ? journal_deferred_lsn : 0);
+}
+
+// Buffered history appender: records are batched in memory under histo_mutex and a
+// background thread appends them to the long-lived history file descriptor
+int histo_fd = -1;
+char *histo_buf = NULL;
+size_t histo_len = 0;
+size_t histo_cap = 0;
+pthread_cond_t histo_cond = PTHREAD_COND_INITIALIZER; // Signalled when HISTO_FLUSH_SIZE is reached
+
+// Queue one history line for the writer thread
+void histo_append(const char *line, int n) {
+    metrics_lock(&histo_mutex, WAIT_HISTO);
+    if (histo_len + n > histo_cap) {
+        size_t cap = histo_cap ? 2 * histo_cap : 2 * HISTO_FLUSH_SIZE;
+        char *tmp = realloc(histo_buf, cap);
+        if (!tmp) {
+            perror("Failed to grow history buffer");
+            pthread_mutex_unlock(&histo_mutex);
+            return;
+        }
+        histo_buf = tmp;
+        histo_cap = cap;
+    }
+    memcpy(histo_buf + histo_len, line, n);
+    histo_len += n;
+    if (histo_len >= HISTO_FLUSH_SIZE) {
+        pthread_cond_signal(&histo_cond);
+    }
+    pthread_mutex_unlock(&histo_mutex);
+}
+
+void logHisto(int sock, struct sockaddr_in *cli_addr, int ref, const char *agence, const char *operation, int valeur, const char *resultat) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Logging history: ref=%d, agency=%s, op=%s, value=%d, result=%s", ref, agence, operation, valeur, resultat);
+
     char line[BUFFER_SIZE];
-    int found = 0;
+    int n = snprintf(line, sizeof(line), "%d %s %s %d %s\n", ref, agence, operation, valeur, resultat);
+    if (n < 0 || n >= (int)sizeof(line)) {
+        return;
+    }
+    histo_append(line, n);
+    debug_print("History logged successfully", cli_addr, sock);
+}
 
-    if (!f || !tmp) {
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        perror("Failed to access invoice files");
-        pthread_mutex_unlock(&facture_mutex);
+// One history line for a whole itinerary, its flights joined with '+' in the reference column
+void logHistoItineraire(int sock, struct sockaddr_in *cli_addr, const int *refs, int nb_refs, const char *agence, int valeur, const char *resultat) {
+    char line[BUFFER_SIZE];
+    int n = 0;
+    for (int i = 0; i < nb_refs; i++) {
+        n += snprintf(line + n, sizeof(line) - n, i ? "+%d" : "%d", refs[i]);
+    }
+    n += snprintf(line + n, sizeof(line) - n, " %s ITINERAIRE %d %s\n", agence, valeur, resultat);
+    if (n >= (int)sizeof(line)) {
         return;
     }
+    histo_append(line, n);
+    debug_print("History logged successfully", cli_addr, sock);
+}
 
-    while (fgets(line, sizeof(line), f)) {
-        char ag[50];
-        int somme;
-        if (sscanf(line, "%s %d", ag, &somme) == 2) {
-            if (strcmp(ag, agence) == 0) {
-                somme += montant;
-                found = 1;
-            }
-            fprintf(tmp, "%s %d\n", ag, somme);
+// Flush the history buffer every HISTO_FLUSH_INTERVAL_MS, or as soon as it holds HISTO_FLUSH_SIZE bytes
+void *histo_writer_thread(void *arg) {
+    (void)arg;
+    char *batch = NULL;
+    size_t batch_cap = 0;
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += HISTO_FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&histo_mutex);
+        while (histo_len < HISTO_FLUSH_SIZE &&
+               pthread_cond_timedwait(&histo_cond, &histo_mutex, &deadline) != ETIMEDOUT) {
+        }
+        // Swap buffers so bookings keep appending while this batch is written
+        char *tmp = histo_buf;
+        size_t tmp_cap = histo_cap;
+        size_t len = histo_len;
+        histo_buf = batch;
+        histo_cap = batch_cap;
+        histo_len = 0;
+        batch = tmp;
+        batch_cap = tmp_cap;
+        pthread_mutex_unlock(&histo_mutex);
+
+        size_t off = 0;
+        while (off < len) {
+            ssize_t n = write(histo_fd, batch + off, len - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("Failed to write history file");
+                break;
+            }
+            off += n;
+        }
+    }
+    return NULL;
+}
+
+int histo_open(const char *path) {
+    histo_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (histo_fd < 0) {
+        perror("Failed to open history file");
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, histo_writer_thread, NULL) != 0) {
+        perror("Failed to create history thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// In-memory invoice ledger: agency -> balance in chained hash buckets, each bucket
+// guarded by one of FACTURE_STRIPES locks so unrelated agencies never contend
+typedef struct Facture {
+    char agence[50];
+    int somme;
+    int somme_durable;      // Balance of the journaled records only, what a checkpoint saves
+    struct Facture *next;
+} Facture;
+
+Facture *factures[FACTURE_BUCKETS];
+pthread_mutex_t facture_locks[FACTURE_STRIPES];
+uint64_t journal_checkpoint_lsn = 0;    // Last record already in FACTURE_FILE and VOL_STORE_FILE
+
+static size_t hash_agence(const char *agence) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)agence; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h & (FACTURE_BUCKETS - 1);
+}
+
+// Find the invoice of an agency, creating it when asked, caller must hold the bucket's stripe lock
+Facture *trouverFacture(const char *agence, size_t bucket, int create) {
+    for (Facture *fa = factures[bucket]; fa; fa = fa->next) {
+        if (strcmp(fa->agence, agence) == 0) {
+            return fa;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    Facture *fa = calloc(1, sizeof(Facture));
+    if (!fa) {
+        perror("Failed to allocate invoice");
+        return NULL;
+    }
+    strncpy(fa->agence, agence, sizeof(fa->agence) - 1);
+    fa->next = factures[bucket];
+    // Published last: a checkpoint walks the buckets without the stripe locks
+    __atomic_store_n(&factures[bucket], fa, __ATOMIC_RELEASE);
+    return fa;
+}
+
+// Load the invoice file into the ledger, the journal replays later changes on top of it.
+// A file written by a checkpoint names the last journal record it includes.
+int chargerFactures(const char *path) {
+    for (int i = 0; i < FACTURE_STRIPES; i++) {
+        pthread_mutex_init(&facture_locks[i], NULL);
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0; // No invoice yet
+    }
+    char line[BUFFER_SIZE];
+    size_t count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char ag[50];
+        int somme;
+        unsigned long long lsn;
+        if (sscanf(line, "# checkpoint %llu", &lsn) == 1) {
+            journal_checkpoint_lsn = lsn;
+            continue;
+        }
+        if (sscanf(line, "%49s %d", ag, &somme) != 2) {
+            continue;
+        }
+        Facture *fa = trouverFacture(ag, hash_agence(ag), 1);
+        if (!fa) {
+            fclose(f);
+            return -1;
+        }
+        fa->somme += somme;
+        fa->somme_durable += somme;
+        count++;
+    }
+    fclose(f);
+
+    log_printf(LOG_INFO, NULL, -1, "Loaded %zu invoices from %s", count, path);
+    return 0;
+}
+
+// Apply an amount to an agency's balance in O(1), persistence is the journal record of the booking
+void updateFacture(int sock, struct sockaddr_in *cli_addr, const char *agence, int montant) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Updating invoice for agency %s, amount=%d", agence, montant);
+
+    size_t bucket = hash_agence(agence);
+    metrics_lock(&facture_locks[bucket % FACTURE_STRIPES], WAIT_FACTURE);
+    Facture *fa = trouverFacture(agence, bucket, 1);
+    if (fa) {
+        fa->somme += montant;
+    }
+    pthread_mutex_unlock(&facture_locks[bucket % FACTURE_STRIPES]);
+    debug_print("Invoice updated successfully", cli_addr, sock);
+}
+
+// Flight store: VOL_STORE_FILE holds fixed-width flight records and their indexes, mapped in
+// memory at startup, so opening it takes the same time for 10 or 10 million flights.
+// Layout: VolStoreHeader padded to VOL_STORE_HEADER_SIZE, then the sections of VolStoreLayout.
+// Destinations and prices never change, so the search indexes are built once by the import.
+//
+// The server maps the file privately: bookings change the seats of a record in memory only.
+// Once the change is in the fsynced journal, the journal writer stores the new seat count in
+// the file through a second, shared mapping. Journal records carry that count as well, so
+// replaying them over a file that already holds some of these stores is harmless.
+typedef struct {
+    char magic[8];              // VOL_STORE_MAGIC
+    uint32_t nb_vols;
+    uint32_t index_size;        // Power of two, at least twice nb_vols
+    uint32_t nb_dests;
+    char titles[BUFFER_SIZE];   // Column titles line of VOL_FILE, sent back with LIST
+} VolStoreHeader;
+
+_Static_assert(sizeof(VolStoreHeader) <= VOL_STORE_HEADER_SIZE, "store header too large");
+
+// Byte offsets of the store sections
+typedef struct {
+    size_t index;       // int32[index_size]: ref -> record (-1 = empty slot)
+    size_t dest_hash;   // int32[index_size]: destination name -> destination id (-1 = empty slot)
+    size_t dest_first;  // uint32[nb_dests + 1]: start of each destination in by_dest
+    size_t by_dest;     // uint32[nb_vols]: records grouped by destination, by price within a group
+    size_t by_price;    // uint32[nb_vols]: records by price, then reference
+    size_t dests;       // char[nb_dests][VOL_DEST_SIZE]: destination names
+    size_t size;
+} VolStoreLayout;
+
+typedef struct {
+    int32_t ref;
+    uint32_t dest;          // Position in the destination table
+    int32_t places;         // Written under lock, read without it through __atomic_load_n
+    int32_t prix;
+} Vol;
+
+Vol *vols = NULL;                   // Records of the private mapping, live seat counts
+Vol *vols_durable = NULL;           // Same records through the shared mapping, journaled seat counts
+size_t vols_store_size = 0;         // Length of both mappings
+size_t nb_vols = 0;
+char vols_header[BUFFER_SIZE] = ""; // Column titles line, sent back with LIST
+int32_t *vols_index = NULL;         // Open-addressing hash: ref -> position in vols (-1 = empty slot)
+size_t vols_index_size = 0;
+const char *vols_dests = NULL;      // Destination names, VOL_DEST_SIZE bytes each
+size_t vols_nb_dests = 0;
+int32_t *vols_dest_hash = NULL;     // Same probing as vols_index, keyed by hash_dest
+uint32_t *vols_dest_first = NULL;
+uint32_t *vols_by_dest = NULL;
+uint32_t *vols_by_price = NULL;
+pthread_mutex_t *vols_locks = NULL; // One per flight, serializes bookings on this flight only
+uint64_t vols_version = 1;          // Bumped on every seat change, starts from the boot time in chargerVols
+
+static size_t hash_ref(int ref) {
+    return ((uint32_t)ref * 2654435761u) & (vols_index_size - 1);
+}
+
+// Find a flight by reference in O(1), records are never added or removed while the server runs
+Vol *trouverVol(int ref) {
+    if (vols_index_size == 0) {
+        return NULL;
+    }
+    for (size_t i = hash_ref(ref); vols_index[i] >= 0; i = (i + 1) & (vols_index_size - 1)) {
+        if (vols[vols_index[i]].ref == ref) {
+            return &vols[vols_index[i]];
+        }
+    }
+    return NULL;
+}
+
+const char *vol_dest(const Vol *v) {
+    return vols_dests + (size_t)v->dest * VOL_DEST_SIZE;
+}
+
+pthread_mutex_t *vol_lock(const Vol *v) {
+    return &vols_locks[v - vols];
+}
+
+static void vol_store_layout(const VolStoreHeader *h, VolStoreLayout *l) {
+    l->index = VOL_STORE_HEADER_SIZE + (size_t)h->nb_vols * sizeof(Vol);
+    l->dest_hash = l->index + (size_t)h->index_size * sizeof(int32_t);
+    l->dest_first = l->dest_hash + (size_t)h->index_size * sizeof(int32_t);
+    l->by_dest = l->dest_first + ((size_t)h->nb_dests + 1) * sizeof(uint32_t);
+    l->by_price = l->by_dest + (size_t)h->nb_vols * sizeof(uint32_t);
+    l->dests = l->by_price + (size_t)h->nb_vols * sizeof(uint32_t);
+    l->size = l->dests + (size_t)h->nb_dests * VOL_DEST_SIZE;
+}
+
+static size_t hash_dest(const char *dest, size_t size) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)dest; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h & (size - 1);
+}
+
+// Destination id of a name, or -1 when no flight goes there
+int trouverDestination(const char *dest) {
+    for (size_t i = hash_dest(dest, vols_index_size); vols_dest_hash[i] >= 0; i = (i + 1) & (vols_index_size - 1)) {
+        if (strcmp(vols_dests + (size_t)vols_dest_hash[i] * VOL_DEST_SIZE, dest) == 0) {
+            return vols_dest_hash[i];
+        }
+    }
+    return -1;
+}
+
+static int cmp_prix(const void *a, const void *b, void *arg) {
+    const Vol *recs = arg;
+    const Vol *x = &recs[*(const uint32_t *)a], *y = &recs[*(const uint32_t *)b];
+    if (x->prix != y->prix) {
+        return x->prix < y->prix ? -1 : 1;
+    }
+    return (x->ref > y->ref) - (x->ref < y->ref);
+}
+
+// Build store_path from the text flight file (VOL_FILE format). The file is written aside and
+// renamed, a running server keeps the catalog it mapped.
+int vol_store_import(const char *text_path, const char *store_path) {
+    FILE *f = fopen(text_path, "r");
+    if (!f) {
+        perror("Failed to open flights file");
+        return -1;
+    }
+    VolStoreHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, VOL_STORE_MAGIC, sizeof(h.magic));
+    size_t capacity = 16;
+    Vol *recs = malloc(capacity * sizeof(Vol));
+    char (*names)[VOL_DEST_SIZE] = malloc(capacity * VOL_DEST_SIZE);
+    int32_t *index = NULL, *dest_hash = NULL;
+    uint32_t *dest_first = NULL, *by_dest = NULL, *by_price = NULL;
+    int rc = -1;
+    if (!recs || !names) {
+        perror("Failed to allocate flight table");
+        goto out;
+    }
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        Vol v;
+        if (sscanf(line, "%d %49s %d %d", &v.ref, names[h.nb_vols], &v.places, &v.prix) != 4) {
+            if (h.nb_vols == 0 && h.titles[0] == '\0') {
+                snprintf(h.titles, sizeof(h.titles), "%s", line);
+            }
+            continue;
+        }
+        recs[h.nb_vols++] = v;
+        if (h.nb_vols == capacity) {
+            Vol *tmp = realloc(recs, 2 * capacity * sizeof(Vol));
+            char (*tmp_names)[VOL_DEST_SIZE] = tmp ? realloc(names, 2 * capacity * VOL_DEST_SIZE) : NULL;
+            if (tmp) {
+                recs = tmp;
+            }
+            if (!tmp_names) {
+                perror("Failed to grow flight table");
+                goto out;
+            }
+            names = tmp_names;
+            capacity *= 2;
+        }
+    }
+
+    // Reference index, duplicates are dropped; destinations are stored once each
+    h.index_size = 16;
+    while (h.index_size < 2 * h.nb_vols) {
+        h.index_size *= 2;
+    }
+    index = malloc(h.index_size * sizeof(int32_t));
+    dest_hash = malloc(h.index_size * sizeof(int32_t));
+    if (!index || !dest_hash) {
+        perror("Failed to allocate flight index");
+        goto out;
+    }
+    memset(index, -1, h.index_size * sizeof(int32_t));
+    memset(dest_hash, -1, h.index_size * sizeof(int32_t));
+    uint32_t kept = 0;
+    for (uint32_t n = 0; n < h.nb_vols; n++) {
+        size_t i = ((uint32_t)recs[n].ref * 2654435761u) & (h.index_size - 1);
+        while (index[i] >= 0 && recs[index[i]].ref != recs[n].ref) {
+            i = (i + 1) & (h.index_size - 1);
+        }
+        if (index[i] >= 0) {
+            fprintf(stderr, "Duplicate flight reference %d ignored\n", recs[n].ref);
+            continue;
+        }
+        size_t d = hash_dest(names[n], h.index_size);
+        while (dest_hash[d] >= 0 && strcmp(names[dest_hash[d]], names[n]) != 0) {
+            d = (d + 1) & (h.index_size - 1);
+        }
+        if (dest_hash[d] < 0) {
+            memmove(names[h.nb_dests], names[n], VOL_DEST_SIZE); // nb_dests <= n, compacts in place
+            dest_hash[d] = (int32_t)h.nb_dests++;
+        }
+        recs[kept] = recs[n];
+        recs[kept].dest = (uint32_t)dest_hash[d];
+        index[i] = (int32_t)kept++;
+    }
+    h.nb_vols = kept;
+
+    // Price order, then grouped by destination with a stable counting sort
+    dest_first = calloc((size_t)h.nb_dests + 1, sizeof(uint32_t));
+    by_dest = malloc(((size_t)h.nb_vols + 1) * sizeof(uint32_t));
+    by_price = malloc(((size_t)h.nb_vols + 1) * sizeof(uint32_t));
+    if (!dest_first || !by_dest || !by_price) {
+        perror("Failed to allocate search indexes");
+        goto out;
+    }
+    for (uint32_t n = 0; n < h.nb_vols; n++) {
+        by_price[n] = n;
+        dest_first[recs[n].dest + 1]++;
+    }
+    qsort_r(by_price, h.nb_vols, sizeof(uint32_t), cmp_prix, recs);
+    for (uint32_t d = 0; d < h.nb_dests; d++) {
+        dest_first[d + 1] += dest_first[d];
+    }
+    for (uint32_t n = 0; n < h.nb_vols; n++) {
+        uint32_t d = recs[by_price[n]].dest;
+        by_dest[dest_first[d]++] = by_price[n];
+    }
+    for (uint32_t d = h.nb_dests; d > 0; d--) {
+        dest_first[d] = dest_first[d - 1]; // Back from group ends to group starts
+    }
+    dest_first[0] = 0;
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store_path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        perror("Failed to create flight store");
+        goto out;
+    }
+    char pad[VOL_STORE_HEADER_SIZE] = {0};
+    memcpy(pad, &h, sizeof(h));
+    if (fwrite(pad, sizeof(pad), 1, out) != 1 || fwrite(recs, sizeof(Vol), h.nb_vols, out) != h.nb_vols ||
+        fwrite(index, sizeof(int32_t), h.index_size, out) != h.index_size ||
+        fwrite(dest_hash, sizeof(int32_t), h.index_size, out) != h.index_size ||
+        fwrite(dest_first, sizeof(uint32_t), h.nb_dests + 1, out) != h.nb_dests + 1 ||
+        fwrite(by_dest, sizeof(uint32_t), h.nb_vols, out) != h.nb_vols ||
+        fwrite(by_price, sizeof(uint32_t), h.nb_vols, out) != h.nb_vols ||
+        fwrite(names, VOL_DEST_SIZE, h.nb_dests, out) != h.nb_dests || fflush(out) != 0 || fsync(fileno(out)) < 0) {
+        perror("Failed to write flight store");
+        fclose(out);
+        unlink(tmp_path);
+        goto out;
+    }
+    fclose(out);
+    if (rename(tmp_path, store_path) < 0) {
+        perror("Failed to replace flight store");
+        unlink(tmp_path);
+        goto out;
+    }
+    log_printf(LOG_INFO, NULL, -1, "Imported %u flights from %s into %s", h.nb_vols, text_path, store_path);
+    rc = 0;
+
+out:
+    fclose(f);
+    free(recs);
+    free(names);
+    free(index);
+    free(dest_hash);
+    free(dest_first);
+    free(by_dest);
+    free(by_price);
+    return rc;
+}
+
+// Write the current seat counts in the text format of VOL_FILE, to text_path or to stdout if NULL
+int vol_store_export(const char *text_path) {
+    if (!text_path) {
+        fputs(vols_header, stdout);
+        for (size_t n = 0; n < nb_vols; n++) {
+            printf("%d %s %d %d\n", vols[n].ref, vol_dest(&vols[n]), vols[n].places, vols[n].prix);
+        }
+        if (fflush(stdout) != 0) {
+            perror("Failed to write flights");
+            return -1;
+        }
+        return 0;
+    }
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", text_path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        perror("Failed to create flights file");
+        return -1;
+    }
+    fputs(vols_header, f);
+    for (size_t n = 0; n < nb_vols; n++) {
+        fprintf(f, "%d %s %d %d\n", vols[n].ref, vol_dest(&vols[n]), vols[n].places, vols[n].prix);
+    }
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        perror("Failed to write flights file");
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp_path, text_path) < 0) {
+        perror("Failed to replace flights file");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Map the flight store, importing it from text_path on first start unless text_path is NULL
+int chargerVols(const char *store_path, const char *text_path) {
+    int fd = open(store_path, O_RDWR);
+    if (fd < 0 && errno == ENOENT && !text_path) {
+        fprintf(stderr, "Flight store %s not found, create it with: import [file]\n", store_path);
+        return -1;
+    }
+    if (fd < 0 && errno == ENOENT) {
+        if (vol_store_import(text_path, store_path) < 0) {
+            return -1;
+        }
+        fd = open(store_path, O_RDWR);
+    }
+    if (fd < 0) {
+        perror("Failed to open flight store");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < VOL_STORE_HEADER_SIZE) {
+        fprintf(stderr, "Flight store %s is truncated\n", store_path);
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    char *shared = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || shared == MAP_FAILED) {
+        perror("Failed to map flight store");
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        if (shared != MAP_FAILED) {
+            munmap(shared, st.st_size);
+        }
+        return -1;
+    }
+    const VolStoreHeader *h = (const VolStoreHeader *)map;
+    VolStoreLayout l;
+    vol_store_layout(h, &l);
+    if (memcmp(h->magic, VOL_STORE_MAGIC, sizeof(h->magic)) != 0 || h->index_size < 2 * h->nb_vols ||
+        (h->index_size & (h->index_size - 1)) != 0 || l.size != (size_t)st.st_size) {
+        fprintf(stderr, "Flight store %s is corrupt or from an older version, rebuild it with: import %s\n", store_path, text_path ? text_path : VOL_FILE);
+        munmap(map, st.st_size);
+        munmap(shared, st.st_size);
+        return -1;
+    }
+    // A zeroed mutex is PTHREAD_MUTEX_INITIALIZER on Linux, and calloc gets fresh zero pages
+    // for large sizes: no per-flight work here
+    vols_locks = calloc(h->nb_vols ? h->nb_vols : 1, sizeof(pthread_mutex_t));
+    if (!vols_locks) {
+        perror("Failed to allocate flight locks");
+        munmap(map, st.st_size);
+        munmap(shared, st.st_size);
+        return -1;
+    }
+
+    vols_store_size = st.st_size;
+    nb_vols = h->nb_vols;
+    vols = (Vol *)(map + VOL_STORE_HEADER_SIZE);
+    vols_durable = (Vol *)(shared + VOL_STORE_HEADER_SIZE);
+    vols_index = (int32_t *)(map + l.index);
+    vols_index_size = h->index_size;
+    vols_dest_hash = (int32_t *)(map + l.dest_hash);
+    vols_dest_first = (uint32_t *)(map + l.dest_first);
+    vols_by_dest = (uint32_t *)(map + l.by_dest);
+    vols_by_price = (uint32_t *)(map + l.by_price);
+    vols_dests = map + l.dests;
+    vols_nb_dests = h->nb_dests;
+    snprintf(vols_header, sizeof(vols_header), "%.*s", (int)sizeof(h->titles) - 1, h->titles);
+
+    // LIST snapshots are identified by version, never reuse one from a previous run
+    vols_version = (uint64_t)time(NULL) << 24;
+
+    log_printf(LOG_INFO, NULL, -1, "Mapped %zu flights from %s", nb_vols, store_path);
+    return 0;
+}
+
+// Drop the shared mapping so that nothing written afterwards reaches the store file: the
+// journal is then replayed into the private mapping only (export reads the store, never changes it)
+void vol_store_detach(void) {
+    if (vols_durable && vols_durable != vols) {
+        munmap((char *)vols_durable - VOL_STORE_HEADER_SIZE, vols_store_size);
+        vols_durable = vols;
+    }
+}
+
+// Append-only journal of seat changes, VOL_STORE_FILE is the base image it is replayed on
+int journal_fd = -1;
+char *journal_buf = NULL;               // Records appended since the last group commit
+size_t journal_len = 0;
+size_t journal_cap = 0;
+
+// Seat count of a flight after a journaled change, copied to the store once the record is durable
+typedef struct {
+    uint32_t pos;
+    int32_t places;
+} VolUpdate;
+
+// Invoice amount of a journaled booking, added to somme_durable once the record is durable
+typedef struct {
+    char agence[50];
+    int montant;
+} FactureUpdate;
+
+VolUpdate *journal_updates = NULL;      // Store updates of the records in journal_buf
+size_t journal_nb_updates = 0;
+size_t journal_updates_cap = 0;
+FactureUpdate *journal_factures = NULL; // Invoice updates of the records in journal_buf
+size_t journal_nb_factures = 0;
+size_t journal_factures_cap = 0;
+size_t journal_size = 0;                // Bytes in JOURNAL_FILE, written by the writer thread only
+size_t journal_delta_records = 0;       // Replayed records without seat counts, from older servers
+uint64_t journal_next_lsn = 1;          // Log sequence number of the next record
+uint64_t journal_durable_lsn = 0;       // Every record up to this LSN is on disk
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;         // Wakes the writer thread
+pthread_cond_t journal_durable_cond = PTHREAD_COND_INITIALIZER; // Wakes threads waiting for a commit
+
+// Replay committed seat and invoice changes on top of the loaded flights and invoices,
+// return the length of the valid prefix of the journal
+long journal_replay(const char *path) {
+    long valid_end = 0;
+    size_t replayed = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[BUFFER_SIZE];
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long long lsn;
+            int ref, delta, montant = 0, consumed = 0;
+            char agence[50], resultat[16];
+            size_t l = strlen(line);
+            if (l == 0 || line[l - 1] != '\n' ||
+                sscanf(line, "%llu %d %d %49s %15s %d%n", &lsn, &ref, &delta, agence, resultat, &montant, &consumed) < 5) {
+                break; // Torn record left by a crash, it was never acknowledged
+            }
+            valid_end = ftell(f);
+            if (lsn <= journal_checkpoint_lsn || lsn < journal_next_lsn) {
+                continue; // Already in the store and the invoice file, or replayed from the segment
+            }
+            journal_next_lsn = lsn + 1;
+            Vol *v = trouverVol(ref);
+            if (v && strcmp(resultat, "OK") == 0) {
+                // Itinerary records list their other legs after the amount, all with the same delta.
+                // Then "= <seats> ..." gives the seat count of every leg after the change: the
+                // store may already hold it, setting it again is harmless where adding is not.
+                int legs[ITINERAIRE_MAX_LEGS], seats[ITINERAIRE_MAX_LEGS], nb_legs = 1, nb_seats = 0, used = 0;
+                const char *p = line + consumed;
+                legs[0] = ref;
+                while (consumed > 0 && nb_legs < ITINERAIRE_MAX_LEGS && sscanf(p, "%d%n", &legs[nb_legs], &used) == 1) {
+                    nb_legs++;
+                    p += used;
+                }
+                used = 0;
+                if (consumed > 0 && sscanf(p, " =%n", &used) == 0 && used > 0) {
+                    p += used;
+                    while (nb_seats < nb_legs && sscanf(p, "%d%n", &seats[nb_seats], &used) == 1) {
+                        nb_seats++;
+                        p += used;
+                    }
+                }
+                for (int i = 0; i < nb_legs; i++) {
+                    Vol *lv = trouverVol(legs[i]);
+                    if (lv && nb_seats == nb_legs) {
+                        // Durable already, a checkpoint relies on the store holding it
+                        lv->places = seats[i];
+                        vols_durable[lv - vols].places = seats[i];
+                    } else if (lv) {
+                        lv->places += delta;
+                        journal_delta_records++;
+                    }
+                }
+                if (montant != 0) {
+                    Facture *fa = trouverFacture(agence, hash_agence(agence), 1);
+                    if (fa) {
+                        fa->somme += montant;
+                        fa->somme_durable += montant;
+                    }
+                }
+                replayed++;
+            }
+        }
+        fclose(f);
+    }
+    log_printf(LOG_INFO, NULL, -1, "Replayed %zu bookings from %s", replayed, path);
+    return valid_end;
+}
+
+// Steps of checkpoint_write, its return value and the checkpoint child's exit status on failure
+typedef enum { CHECKPOINT_OK, CHECKPOINT_SYNC_STORE, CHECKPOINT_CREATE, CHECKPOINT_WRITE, CHECKPOINT_RENAME, CHECKPOINT_UNLINK } CheckpointStep;
+
+const char *checkpoint_errors[] = {
+    "", "Failed to sync flight store", "Failed to create invoice file", "Failed to write invoice file",
+    "Failed to replace invoice file", "Failed to remove journal segment"
+};
+
+// Invoice file being written by checkpoint_write, flushed with write(2) whenever it is full
+typedef struct {
+    int fd;
+    size_t len;
+    char data[64 * 1024];
+} CheckpointBuf;
+
+static int checkpoint_flush(CheckpointBuf *b) {
+    for (size_t off = 0; off < b->len;) {
+        ssize_t n = write(b->fd, b->data + off, b->len - off);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        off += n > 0 ? (size_t)n : 0;
+    }
+    b->len = 0;
+    return 0;
+}
+
+static int checkpoint_put(CheckpointBuf *b, const char *s, size_t len) {
+    if (b->len + len > sizeof(b->data) && checkpoint_flush(b) < 0) {
+        return -1;
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    return 0;
+}
+
+static int checkpoint_put_num(CheckpointBuf *b, long long v) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) {
+        *--p = '-';
+    }
+    return checkpoint_put(b, p, digits + sizeof(digits) - p);
+}
+
+// Make the flight store durable and write the invoice balances of every record up to lsn to
+// FACTURE_FILE, stamped with lsn. Runs in the checkpoint child, whose memory is a copy of the
+// server's taken between two group commits, or at startup before any other thread exists.
+// The child may have been forked while another thread held a stdio or malloc lock, so this
+// only makes system calls. Returns CHECKPOINT_OK or the step that failed, with errno set.
+CheckpointStep checkpoint_write(uint64_t lsn) {
+    // Seat counts past lsn may already be stored: journal records set seats, replaying them is harmless
+    char *store = (char *)vols_durable - VOL_STORE_HEADER_SIZE;
+    if (msync(store, VOL_STORE_HEADER_SIZE + nb_vols * sizeof(Vol), MS_SYNC) < 0) {
+        return CHECKPOINT_SYNC_STORE;
+    }
+    static const char tmp_path[] = FACTURE_FILE ".tmp";
+    static const char header[] = "Référence Agence  Somme à payer\n# checkpoint ";
+    static CheckpointBuf b;
+    b.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    b.len = 0;
+    if (b.fd < 0) {
+        return CHECKPOINT_CREATE;
+    }
+    int failed = checkpoint_put(&b, header, sizeof(header) - 1) < 0 || checkpoint_put_num(&b, (long long)lsn) < 0 ||
+                 checkpoint_put(&b, "\n", 1) < 0;
+    for (size_t i = 0; i < FACTURE_BUCKETS && !failed; i++) {
+        for (Facture *fa = __atomic_load_n(&factures[i], __ATOMIC_ACQUIRE); fa && !failed; fa = fa->next) {
+            failed = checkpoint_put(&b, fa->agence, strlen(fa->agence)) < 0 || checkpoint_put(&b, " ", 1) < 0 ||
+                     checkpoint_put_num(&b, fa->somme_durable) < 0 || checkpoint_put(&b, "\n", 1) < 0;
+        }
+    }
+    if (failed || checkpoint_flush(&b) < 0 || fsync(b.fd) < 0) {
+        int err = errno;
+        close(b.fd);
+        unlink(tmp_path);
+        errno = err;
+        return CHECKPOINT_WRITE;
+    }
+    close(b.fd);
+    int dir = open(".", O_RDONLY | O_DIRECTORY);
+    if (rename(tmp_path, FACTURE_FILE) < 0 || dir < 0 || fsync(dir) < 0) {
+        int err = errno;
+        if (dir >= 0) {
+            close(dir);
+        }
+        errno = err;
+        return CHECKPOINT_RENAME;
+    }
+    close(dir);
+    // The records of the segment are all in the checkpoint now
+    if (unlink(JOURNAL_SEGMENT_FILE) < 0 && errno != ENOENT) {
+        return CHECKPOINT_UNLINK;
+    }
+    return CHECKPOINT_OK;
+}
+
+// Replay the journal, then open it for appending. A segment left by a checkpoint that did not
+// finish holds older records: replay it first, then complete the checkpoint it was for. Records
+// of older servers only give a seat delta, they are folded into a checkpoint at once too.
+int journal_open(const char *path) {
+    int segment = access(JOURNAL_SEGMENT_FILE, F_OK) == 0;
+    if (segment) {
+        journal_replay(JOURNAL_SEGMENT_FILE);
+    }
+    long valid_end = journal_replay(path);
+    if (journal_next_lsn <= journal_checkpoint_lsn) {
+        journal_next_lsn = journal_checkpoint_lsn + 1; // The journal was emptied by the last checkpoint
+    }
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0) {
+        perror("Failed to open journal");
+        return -1;
+    }
+    if (ftruncate(journal_fd, valid_end) < 0) {
+        perror("Failed to truncate journal");
+        close(journal_fd);
+        return -1;
+    }
+    journal_size = valid_end;
+    journal_durable_lsn = journal_next_lsn - 1;
+    if (segment || journal_delta_records > 0) {
+        // Nothing else runs yet: the live seats are the durable ones
+        for (size_t i = 0; i < nb_vols; i++) {
+            vols_durable[i].places = vols[i].places;
+        }
+        CheckpointStep step = checkpoint_write(journal_durable_lsn);
+        if (step != CHECKPOINT_OK) {
+            perror(checkpoint_errors[step]);
+            close(journal_fd);
+            return -1;
+        }
+        journal_checkpoint_lsn = journal_durable_lsn;
+        log_printf(LOG_INFO, NULL, -1, "Checkpoint at LSN %llu written at startup", (unsigned long long)journal_durable_lsn);
+    }
+    return 0;
+}
+
+// Queue a seat change on one or more flights and the matching invoice amount for the next
+// group commit, return its LSN. All legs share one record so a crash keeps all or none of them.
+// The caller holds the lock of every leg and has already applied the change.
+uint64_t journal_append_legs(const int *refs, int nb_refs, int delta, const char *agence, const char *resultat, int montant) {
+    char rec[128 + 24 * ITINERAIRE_MAX_LEGS];
+    Vol *legs[ITINERAIRE_MAX_LEGS];
+    int changed = strcmp(resultat, "OK") == 0;
+    for (int i = 0; i < nb_refs; i++) {
+        legs[i] = trouverVol(refs[i]);
+        changed = changed && legs[i];
+    }
+    pthread_mutex_lock(&journal_mutex);
+    uint64_t lsn = journal_next_lsn++;
+    int n = snprintf(rec, sizeof(rec), "%llu %d %d %s %s %d", (unsigned long long)lsn, refs[0], delta, agence, resultat, montant);
+    for (int i = 1; i < nb_refs; i++) {
+        n += snprintf(rec + n, sizeof(rec) - n, " %d", refs[i]);
+    }
+    if (changed) {
+        n += snprintf(rec + n, sizeof(rec) - n, " =");
+        for (int i = 0; i < nb_refs; i++) {
+            n += snprintf(rec + n, sizeof(rec) - n, " %d", legs[i]->places);
+        }
+        if (journal_nb_updates + nb_refs > journal_updates_cap) {
+            size_t cap = journal_updates_cap ? 2 * journal_updates_cap : 4096;
+            VolUpdate *tmp = realloc(journal_updates, cap * sizeof(VolUpdate));
+            if (!tmp) {
+                perror("Failed to grow journal buffer");
+                exit(1);
+            }
+            journal_updates = tmp;
+            journal_updates_cap = cap;
+        }
+        for (int i = 0; i < nb_refs; i++) {
+            journal_updates[journal_nb_updates++] = (VolUpdate){ (uint32_t)(legs[i] - vols), legs[i]->places };
+        }
+    }
+    if (changed && montant != 0) {
+        if (journal_nb_factures == journal_factures_cap) {
+            size_t cap = journal_factures_cap ? 2 * journal_factures_cap : 4096;
+            FactureUpdate *tmp = realloc(journal_factures, cap * sizeof(FactureUpdate));
+            if (!tmp) {
+                perror("Failed to grow journal buffer");
+                exit(1);
+            }
+            journal_factures = tmp;
+            journal_factures_cap = cap;
+        }
+        FactureUpdate *fu = &journal_factures[journal_nb_factures++];
+        snprintf(fu->agence, sizeof(fu->agence), "%s", agence);
+        fu->montant = montant;
+    }
+    rec[n++] = '\n';
+    if (journal_len + n > journal_cap) {
+        size_t cap = journal_cap ? 2 * journal_cap : 64 * 1024;
+        char *tmp = realloc(journal_buf, cap);
+        if (!tmp) {
+            perror("Failed to grow journal buffer");
+            exit(1);
+        }
+        journal_buf = tmp;
+        journal_cap = cap;
+    }
+    memcpy(journal_buf + journal_len, rec, n);
+    journal_len += n;
+    pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    return lsn;
+}
+
+uint64_t journal_append(int ref, int delta, const char *agence, const char *resultat, int montant) {
+    return journal_append_legs(&ref, 1, delta, agence, resultat, montant);
+}
+
+// Block until the record with this LSN has been fsynced
+void journal_wait(uint64_t lsn) {
+    if (journal_defer) {
+        if (lsn > journal_deferred_lsn) {
+            journal_deferred_lsn = lsn;
+        }
+        return;
+    }
+    pthread_mutex_lock(&journal_mutex);
+    while (journal_durable_lsn < lsn) {
+        pthread_cond_wait(&journal_durable_cond, &journal_mutex);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Wait once for every record deferred so far, journal_defer stays set
+void journal_wait_deferred(void) {
+    uint64_t lsn = journal_deferred_lsn;
+    int defer = journal_defer;
+    journal_deferred_lsn = 0;
+    journal_defer = 0;
+    journal_wait(lsn);
+    journal_defer = defer;
+}
+
+pid_t checkpoint_pid = 0;            // Checkpoint child still running, reaped by the writer thread
+uint64_t checkpoint_running_lsn = 0;
+time_t checkpoint_last = 0;
+time_t checkpoint_started = 0;
+
+// Start a checkpoint of every record up to lsn: move the journal aside as JOURNAL_SEGMENT_FILE and
+// fork a child that writes the snapshot from its copy-on-write image of the server. Called by the
+// writer thread between two group commits, when the durable seats and balances are exactly those
+// of the records up to lsn. Bookings go on in the parent, into a fresh JOURNAL_FILE.
+void checkpoint_start(uint64_t lsn) {
+    // A segment still there belongs to a checkpoint that failed: this one covers it as well
+    if (access(JOURNAL_SEGMENT_FILE, F_OK) != 0) {
+        if (rename(JOURNAL_FILE, JOURNAL_SEGMENT_FILE) < 0) {
+            perror("Failed to rotate journal");
+            return;
+        }
+        // New records must not go to a file whose name a crash could lose
+        int fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+        int dir = open(".", O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || dir < 0 || fsync(dir) < 0) {
+            perror("Failed to rotate journal");
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (dir >= 0) {
+                close(dir);
+            }
+            if (rename(JOURNAL_SEGMENT_FILE, JOURNAL_FILE) < 0) {
+                perror("Failed to restore journal");
+                exit(1);
+            }
+            return;
+        }
+        close(dir);
+        close(journal_fd);
+        journal_fd = fd;
+        journal_size = 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(checkpoint_write(lsn)); // Status 0, or the CheckpointStep that failed
+    }
+    if (pid < 0) {
+        perror("Failed to fork checkpoint");
+        return;
+    }
+    checkpoint_pid = pid;
+    checkpoint_running_lsn = lsn;
+    checkpoint_started = time(NULL);
+    log_printf(LOG_DEBUG, NULL, -1, "Checkpoint at LSN %llu started", (unsigned long long)lsn);
+}
+
+// Reap the checkpoint child, killing it once it has run for CHECKPOINT_TIMEOUT_SEC, and start
+// a new checkpoint when the journal is old or large enough
+void checkpoint_poll(uint64_t durable_lsn) {
+    if (checkpoint_pid > 0) {
+        int status;
+        pid_t r = waitpid(checkpoint_pid, &status, WNOHANG);
+        if (r == 0) {
+            if (time(NULL) - checkpoint_started < CHECKPOINT_TIMEOUT_SEC) {
+                return;
+            }
+            kill(checkpoint_pid, SIGKILL);
+            r = waitpid(checkpoint_pid, &status, 0);
+        }
+        if (r == checkpoint_pid && WIFEXITED(status) && WEXITSTATUS(status) == CHECKPOINT_OK) {
+            journal_checkpoint_lsn = checkpoint_running_lsn;
+            log_printf(LOG_INFO, NULL, -1, "Checkpoint at LSN %llu written", (unsigned long long)checkpoint_running_lsn);
+        } else {
+            int step = r == checkpoint_pid && WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+            const char *why = step > CHECKPOINT_OK && step <= CHECKPOINT_UNLINK ? checkpoint_errors[step]
+                              : r == checkpoint_pid && WIFSIGNALED(status) ? "Killed"
+                                                                           : "Lost";
+            log_printf(LOG_WARN, NULL, -1, "Checkpoint at LSN %llu failed (%s), %s kept for replay",
+                       (unsigned long long)checkpoint_running_lsn, why, JOURNAL_SEGMENT_FILE);
+        }
+        checkpoint_pid = 0;
+        checkpoint_last = time(NULL);
+    }
+    if (durable_lsn > journal_checkpoint_lsn &&
+        (journal_size >= CHECKPOINT_JOURNAL_SIZE || time(NULL) - checkpoint_last >= CHECKPOINT_INTERVAL_SEC)) {
+        checkpoint_start(durable_lsn);
+    }
+}
+
+// Group commit: every record queued while the previous fsync ran goes out in one write + fsync.
+// Between two batches the writer also runs the checkpoints that keep the journal short.
+void *journal_writer_thread(void *arg) {
+    (void)arg;
+    char *batch = NULL;
+    size_t batch_cap = 0;
+    VolUpdate *updates = NULL;
+    size_t updates_cap = 0;
+    FactureUpdate *facture_updates = NULL;
+    size_t facture_updates_cap = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    checkpoint_last = time(NULL);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        pthread_mutex_lock(&journal_mutex);
+        while (journal_len == 0 && pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (journal_len == 0) {
+            uint64_t durable_lsn = journal_durable_lsn;
+            pthread_mutex_unlock(&journal_mutex);
+            checkpoint_poll(durable_lsn);
+            continue;
+        }
+        // Swap buffers so appenders are not blocked during the disk I/O
+        char *tmp = journal_buf;
+        size_t tmp_cap = journal_cap;
+        size_t len = journal_len;
+        journal_buf = batch;
+        journal_cap = batch_cap;
+        journal_len = 0;
+        batch = tmp;
+        batch_cap = tmp_cap;
+        VolUpdate *tmp_updates = journal_updates;
+        size_t tmp_updates_cap = journal_updates_cap;
+        size_t nb_updates = journal_nb_updates;
+        journal_updates = updates;
+        journal_updates_cap = updates_cap;
+        journal_nb_updates = 0;
+        updates = tmp_updates;
+        updates_cap = tmp_updates_cap;
+        FactureUpdate *tmp_factures = journal_factures;
+        size_t tmp_factures_cap = journal_factures_cap;
+        size_t nb_factures = journal_nb_factures;
+        journal_factures = facture_updates;
+        journal_factures_cap = facture_updates_cap;
+        journal_nb_factures = 0;
+        facture_updates = tmp_factures;
+        facture_updates_cap = tmp_factures_cap;
+        uint64_t last_lsn = journal_next_lsn - 1;
+        pthread_mutex_unlock(&journal_mutex);
+
+        size_t off = 0;
+        while (off < len) {
+            ssize_t n = write(journal_fd, batch + off, len - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                // Acknowledged bookings can no longer be made durable, stop rather than lie to clients
+                perror("Failed to write journal");
+                exit(1);
+            }
+            off += n;
+        }
+        if (fdatasync(journal_fd) < 0) {
+            perror("Failed to sync journal");
+            exit(1);
+        }
+        journal_size += len;
+
+        pthread_mutex_lock(&journal_mutex);
+        journal_durable_lsn = last_lsn;
+        pthread_cond_broadcast(&journal_durable_cond);
+        pthread_mutex_unlock(&journal_mutex);
+
+        // The batch is durable: store its seat counts in place in the flight store, in LSN order
+        if (nb_updates > 0) {
+            uint32_t lo = updates[0].pos, hi = updates[0].pos;
+            for (size_t i = 0; i < nb_updates; i++) {
+                vols_durable[updates[i].pos].places = updates[i].places;
+                lo = updates[i].pos < lo ? updates[i].pos : lo;
+                hi = updates[i].pos > hi ? updates[i].pos : hi;
+            }
+            uintptr_t start = (uintptr_t)&vols_durable[lo] & ~(uintptr_t)(page - 1);
+            uintptr_t end = (uintptr_t)&vols_durable[hi + 1];
+            if (msync((void *)start, end - start, MS_ASYNC) < 0) {
+                perror("Failed to sync flight store");
+            }
+        }
+        // and its amounts in the balances a checkpoint saves
+        for (size_t i = 0; i < nb_factures; i++) {
+            size_t bucket = hash_agence(facture_updates[i].agence);
+            pthread_mutex_lock(&facture_locks[bucket % FACTURE_STRIPES]);
+            Facture *fa = trouverFacture(facture_updates[i].agence, bucket, 1);
+            if (fa) {
+                fa->somme_durable += facture_updates[i].montant;
+            }
+            pthread_mutex_unlock(&facture_locks[bucket % FACTURE_STRIPES]);
+        }
+        checkpoint_poll(last_lsn);
+    }
+    return NULL;
+}
+
+// Lock a single flight, telling the client to wait only if another booking holds this flight
+void lockVol(Vol *v, int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq) {
+    if (pthread_mutex_trylock(vol_lock(v)) != 0) {
+        char resource[64];
+        snprintf(resource, sizeof(resource), "flight %d", v->ref);
+        send_wait_message(sock, cli_addr, cli_len, resource, proto, seq);
+        uint64_t start = metrics_now_ns();
+        pthread_mutex_lock(vol_lock(v));
+        metrics_lock_waited(WAIT_VOL, metrics_now_ns() - start);
+    }
+}
+
+// Sharded mode: flights are split by reference across nb_shards pinned threads, and each shard
+// thread is the only one to change the seats of its flights, without flight locks. Requests
+// reach it through a lock-free queue of messages that live on the requesting thread's stack.
+typedef struct Shard Shard;
+
+typedef struct ShardMsg {
+    struct ShardMsg *next;
+    void (*run)(struct ShardMsg *m);    // Runs on the shard, posts done when the requester may go on
+    sem_t *done;
+    Shard *shard;
+    Vol *v;
+    int nb_places;
+    const char *agence;
+    int places;                         // Reservation: seats there were before
+    int montant;                        // Cancellation: amount to journal
+    uint64_t lsn;
+} ShardMsg;
+
+struct Shard {
+    ShardMsg *head;                     // Pushed by any thread, taken whole by the shard thread
+    int sleeping;
+    pthread_mutex_t sleep_mutex;        // Only to sleep and wake up, never held while working
+    pthread_cond_t wake;
+    sem_t release;                      // Posted by the requester that froze the shard
+} __attribute__((aligned(64)));
+
+Shard *shards = NULL;
+int nb_shards = 0;                      // 0: flight locks instead of shards
+__thread sem_t shard_done_sem;
+__thread int shard_done_sem_ready = 0;
+
+Shard *shard_of(const Vol *v) {
+    return &shards[(uint32_t)v->ref % nb_shards];
+}
+
+void shard_push(Shard *sh, ShardMsg *m) {
+    m->next = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sh->head, &m->next, m, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+    if (__atomic_load_n(&sh->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&sh->sleep_mutex);
+        pthread_cond_signal(&sh->wake);
+        pthread_mutex_unlock(&sh->sleep_mutex);
+    }
+}
+
+// Send a message to a shard and wait until it has run
+void shard_call(Shard *sh, ShardMsg *m) {
+    if (!shard_done_sem_ready) {
+        sem_init(&shard_done_sem, 0, 0);
+        shard_done_sem_ready = 1;
+    }
+    m->done = &shard_done_sem;
+    m->shard = sh;
+    shard_push(sh, m);
+    while (sem_wait(&shard_done_sem) < 0 && errno == EINTR) {
+    }
+}
+
+void *shard_thread(void *arg) {
+    Shard *sh = arg;
+    while (1) {
+        ShardMsg *list = __atomic_exchange_n(&sh->head, NULL, __ATOMIC_ACQUIRE);
+        if (!list) {
+            pthread_mutex_lock(&sh->sleep_mutex);
+            __atomic_store_n(&sh->sleeping, 1, __ATOMIC_SEQ_CST);
+            while (!__atomic_load_n(&sh->head, __ATOMIC_SEQ_CST)) {
+                pthread_cond_wait(&sh->wake, &sh->sleep_mutex);
+            }
+            __atomic_store_n(&sh->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&sh->sleep_mutex);
+            continue;
+        }
+        // Pushed newest first: run them in arrival order
+        ShardMsg *fifo = NULL;
+        while (list) {
+            ShardMsg *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        while (fifo) {
+            ShardMsg *next = fifo->next; // The message is gone once run has posted done
+            fifo->run(fifo);
+            fifo = next;
+        }
+    }
+    return NULL;
+}
+
+// Freeze: the shard stops until the requester, which changes its flights meanwhile, releases it
+void shard_freeze(ShardMsg *m) {
+    Shard *sh = m->shard;
+    sem_post(m->done);
+    while (sem_wait(&sh->release) < 0 && errno == EINTR) {
+    }
+}
+
+// Start one shard per core, each pinned to its core
+// CPUs this process may run on (taskset, cgroup cpuset), all online CPUs if the mask is unknown.
+// Returns how many there are.
+int cpus_allowed(cpu_set_t *cpus) {
+    if (sched_getaffinity(0, sizeof(*cpus), cpus) == 0 && CPU_COUNT(cpus) > 0) {
+        return CPU_COUNT(cpus);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(cpus);
+    for (long i = 0; i < (n > 0 ? n : 1) && i < CPU_SETSIZE; i++) {
+        CPU_SET(i, cpus);
+    }
+    return CPU_COUNT(cpus);
+}
+
+// Start n shards, pinned round-robin over the CPUs of the process's affinity mask
+int shards_start(int n) {
+    cpu_set_t allowed;
+    int nb_allowed = cpus_allowed(&allowed);
+    shards = calloc(n, sizeof(Shard));
+    if (!shards) {
+        perror("Failed to allocate shards");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&shards[i].sleep_mutex, NULL);
+        pthread_cond_init(&shards[i].wake, NULL);
+        sem_init(&shards[i].release, 0, 0);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shard_thread, &shards[i]) != 0) {
+            perror("Failed to create shard thread");
+            return -1;
+        }
+        // The (i % nb_allowed)-th allowed CPU
+        int cpu = -1;
+        for (int k = i % nb_allowed; k >= 0; k--) {
+            while (!CPU_ISSET(++cpu, &allowed)) {
+            }
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+            log_printf(LOG_WARN, NULL, -1, "Failed to pin shard %d to CPU %d", i, cpu);
+        }
+        pthread_detach(thread);
+    }
+    nb_shards = n;
+    log_printf(LOG_INFO, NULL, -1, "Started %d flight shards", n);
+    return 0;
+}
+
+// Take nb_places seats of a flight if there are enough and journal the outcome. *places gets
+// the seats there were. Runs under the flight lock, or on the shard owning the flight.
+uint64_t vol_take(Vol *v, int nb_places, const char *agence, int *places) {
+    *places = v->places;
+    if (*places < nb_places) {
+        return journal_append(v->ref, -nb_places, agence, "FAILED", 0);
+    }
+    __atomic_store_n(&v->places, *places - nb_places, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&vols_version, 1, __ATOMIC_RELEASE);
+    return journal_append(v->ref, -nb_places, agence, "OK", nb_places * v->prix);
+}
+
+// Give back nb_places seats of a flight and journal it with the invoice amount, same context
+uint64_t vol_give_back(Vol *v, int nb_places, const char *agence, int montant) {
+    __atomic_store_n(&v->places, v->places + nb_places, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&vols_version, 1, __ATOMIC_RELEASE);
+    return journal_append(v->ref, nb_places, agence, "OK", montant);
+}
+
+void shard_reserver(ShardMsg *m) {
+    m->lsn = vol_take(m->v, m->nb_places, m->agence, &m->places);
+    sem_post(m->done);
+}
+
+void shard_annuler(ShardMsg *m) {
+    m->lsn = vol_give_back(m->v, m->nb_places, m->agence, m->montant);
+    sem_post(m->done);
+}
+
+// Pre-serialized LIST reply, rebuilt only when vols_version moved since it was built
+typedef struct {
+    uint64_t version;
+    int refs;           // Threads still sending it, plus one while it is the current cache
+    char *text;         // Header line and one line per flight, followed by "END\n"
+    size_t len;
+    size_t *chunks;     // UDP chunk i carries text[chunks[i] .. chunks[i + 1])
+    size_t nb_chunks;
+} ListCache;
+
+ListCache *list_cache = NULL;
+pthread_mutex_t list_cache_mutex = PTHREAD_MUTEX_INITIALIZER;   // Guards list_cache and the reference counts
+pthread_mutex_t list_rebuild_mutex = PTHREAD_MUTEX_INITIALIZER; // Only one thread rebuilds a stale cache
+
+void list_cache_free(ListCache *lc) {
+    free(lc->text);
+    free(lc->chunks);
+    free(lc);
+}
+
+ListCache *list_cache_build(uint64_t version) {
+    ListCache *lc = calloc(1, sizeof(ListCache));
+    size_t cap = strlen(vols_header) + 64 * (nb_vols + 1);
+    if (!lc || !(lc->text = malloc(cap)) || !(lc->chunks = malloc((nb_vols + 2) * sizeof(size_t)))) {
+        if (lc) {
+            list_cache_free(lc);
+        }
+        return NULL;
+    }
+    lc->version = version;
+    for (size_t n = 0; n <= nb_vols; n++) {
+        char line[BUFFER_SIZE];
+        int l;
+        if (n == 0) {
+            l = snprintf(line, sizeof(line), "%s", vols_header);
+        } else {
+            Vol *v = &vols[n - 1];
+            l = snprintf(line, sizeof(line), "%d %s %d %d\n", v->ref, vol_dest(v), __atomic_load_n(&v->places, __ATOMIC_RELAXED), v->prix);
+        }
+        if (l <= 0) {
+            continue;
+        }
+        if (lc->len + l + 5 > cap) {
+            cap = 2 * (lc->len + l + 5);
+            char *tmp = realloc(lc->text, cap);
+            if (!tmp) {
+                list_cache_free(lc);
+                return NULL;
+            }
+            lc->text = tmp;
+        }
+        memcpy(lc->text + lc->len, line, l);
+        lc->len += l;
+    }
+
+    // Pack whole lines into datagrams of at most chunk_max bytes, a longer line (header from
+    // vols.txt) is cut over several chunks
+    size_t chunk_max = MAX_DATAGRAM_SIZE - sizeof(UdpHeader) - sizeof(ListChunkHeader);
+    size_t chunks_cap = nb_vols + 2;
+    lc->chunks[0] = 0;
+    do {
+        if (lc->nb_chunks + 2 > chunks_cap) {
+            chunks_cap *= 2;
+            size_t *tmp = realloc(lc->chunks, chunks_cap * sizeof(size_t));
+            if (!tmp) {
+                list_cache_free(lc);
+                return NULL;
+            }
+            lc->chunks = tmp;
+        }
+        lc->chunks[lc->nb_chunks + 1] = udp_chunk_end(lc->text, lc->chunks[lc->nb_chunks], lc->len, chunk_max);
+        lc->nb_chunks++;
+    } while (lc->chunks[lc->nb_chunks] < lc->len);
+    memcpy(lc->text + lc->len, "END\n", 4);
+    lc->len += 4;
+    return lc;
+}
+
+// Get the LIST reply for the current seat counts, release it with list_cache_release
+ListCache *list_cache_acquire(void) {
+    uint64_t version = __atomic_load_n(&vols_version, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&list_cache_mutex);
+    ListCache *lc = list_cache;
+    if (lc && lc->version >= version) {
+        lc->refs++;
+        pthread_mutex_unlock(&list_cache_mutex);
+        return lc;
+    }
+    pthread_mutex_unlock(&list_cache_mutex);
+
+    pthread_mutex_lock(&list_rebuild_mutex);
+    pthread_mutex_lock(&list_cache_mutex);
+    lc = list_cache;
+    if (lc && lc->version >= version) {
+        // Rebuilt by another thread while we were waiting
+        lc->refs++;
+        pthread_mutex_unlock(&list_cache_mutex);
+        pthread_mutex_unlock(&list_rebuild_mutex);
+        return lc;
+    }
+    pthread_mutex_unlock(&list_cache_mutex);
+
+    version = __atomic_load_n(&vols_version, __ATOMIC_ACQUIRE);
+    lc = list_cache_build(version);
+    if (lc) {
+        lc->refs = 2;
+        pthread_mutex_lock(&list_cache_mutex);
+        ListCache *old = list_cache;
+        list_cache = lc;
+        if (old && --old->refs == 0) {
+            list_cache_free(old);
+        }
+        pthread_mutex_unlock(&list_cache_mutex);
+        debug_print("Flight list cache rebuilt", NULL, -1);
+    }
+    pthread_mutex_unlock(&list_rebuild_mutex);
+    return lc;
+}
+
+void list_cache_release(ListCache *lc) {
+    pthread_mutex_lock(&list_cache_mutex);
+    if (--lc->refs == 0) {
+        list_cache_free(lc);
+    }
+    pthread_mutex_unlock(&list_cache_mutex);
+}
+
+int send_list_chunk(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, uint32_t seq, ListCache *lc, size_t i) {
+    size_t off = lc->chunks[i];
+    size_t len = lc->chunks[i + 1] - off;
+    UdpHeader header = { seq, "LIST", (uint32_t)(sizeof(ListChunkHeader) + len) };
+    ListChunkHeader chunk = { lc->version, (uint32_t)i, (uint32_t)lc->nb_chunks };
+    struct iovec iov[3] = { { &header, sizeof(header) }, { &chunk, sizeof(chunk) }, { lc->text + off, len } };
+    if (udp_sendv(sock, iov, 3, (struct sockaddr *)cli_addr, cli_len) < 0) {
+        perror("Failed to send flight list via UDP");
+        return -1;
+    }
+    return 0;
+}
+
+void sendVols(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq) {
+    debug_print("Sending flight list", cli_addr, sock);
+    ListCache *lc = list_cache_acquire();
+    if (!lc) {
+        debug_print("Failed to build flight list", cli_addr, sock);
+        metrics_failed = 1;
+        send_reply(sock, cli_addr, cli_len, proto, seq, "ERR", REPLY_TEXT("Error: Unable to build flight list\n"));
+        return;
+    }
+
+    if (proto == PROTO_TCP) {
+        // Whole list and END marker in a single write
+        if (tcp_send(sock, lc->text, lc->len) != (ssize_t)lc->len) {
+            perror("Failed to send flight list");
+        }
+    } else {
+        for (size_t i = 0; i < lc->nb_chunks; i++) {
+            if (send_list_chunk(sock, cli_addr, cli_len, seq, lc, i) < 0) {
+                break;
+            }
+        }
+    }
+    list_cache_release(lc);
+    debug_print("Flight list sent successfully", cli_addr, sock);
+}
+
+// Resend the chunks a UDP client is missing. If the list changed since, the client gets the
+// whole new version and starts over.
+void sendVolsChunks(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, uint32_t seq, uint64_t version, const uint32_t *wanted, int nb_wanted) {
+    ListCache *lc = list_cache_acquire();
+    if (!lc || lc->version != version) {
+        if (lc) {
+            list_cache_release(lc);
+        }
+        debug_print("Flight list changed, sending the new version", cli_addr, sock);
+        sendVols(sock, cli_addr, cli_len, PROTO_UDP, seq);
+        return;
+    }
+    log_printf(LOG_DEBUG, cli_addr, sock, "Resending %d flight list chunks", nb_wanted);
+    for (int i = 0; i < nb_wanted; i++) {
+        if (wanted[i] < lc->nb_chunks && send_list_chunk(sock, cli_addr, cli_len, seq, lc, wanted[i]) < 0) {
+            break;
+        }
+    }
+    list_cache_release(lc);
+}
+
+void reserverVol(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, int ref, int nb_places, const char *agence, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Processing reservation: ref=%d, seats=%d, agency=%s", ref, nb_places, agence);
+    
+    Vol *v = trouverVol(ref);
+    if (!v) {
+        debug_print("Flight reference not found", cli_addr, sock);
+        metrics_failed = 1;
+        send_reply(sock, cli_addr, cli_len, proto, seq, "ERR", REPLY_TEXT("Error: Flight reference not found\n"));
+        logHisto(sock, cli_addr, ref, agence, "RESERVATION", nb_places, "UNKNOWN");
+        return;
+    }
+
+    int places;
+    int prix = v->prix;
+    uint64_t lsn;
+    if (nb_shards > 0) {
+        ShardMsg m = { .run = shard_reserver, .v = v, .nb_places = nb_places, .agence = agence };
+        shard_call(shard_of(v), &m);
+        places = m.places;
+        lsn = m.lsn;
+    } else {
+        lockVol(v, sock, cli_addr, cli_len, proto, seq);
+        lsn = vol_take(v, nb_places, agence, &places);
+        pthread_mutex_unlock(vol_lock(v));
+    }
+
+    if (places >= nb_places) {
+        updateFacture(sock, cli_addr, agence, nb_places * prix);
+        journal_wait(lsn);
+        send_replyf(sock, cli_addr, cli_len, proto, seq, "RSRV", "Reservation confirmed: %d seats on flight %d\n", nb_places, ref);
+        logHisto(sock, cli_addr, ref, agence, "RESERVATION", nb_places, "OK");
+    } else {
+        metrics_failed = 1;
+        send_replyf(sock, cli_addr, cli_len, proto, seq, "ERR", "Error: only %d seats available\n", places);
+        logHisto(sock, cli_addr, ref, agence, "RESERVATION", nb_places, "FAILED");
+    }
+}
+
+void annulerVol(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, int ref, int nb_places, const char *agence, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Processing cancellation: ref=%d, seats=%d, agency=%s", ref, nb_places, agence);
+    
+    Vol *v = trouverVol(ref);
+    if (!v) {
+        debug_print("Flight reference not found", cli_addr, sock);
+        metrics_failed = 1;
+        send_reply(sock, cli_addr, cli_len, proto, seq, "ERR", REPLY_TEXT("Error: Flight reference not found\n"));
+        logHisto(sock, cli_addr, ref, agence, "CANCELLATION", nb_places, "UNKNOWN");
+        return;
+    }
+
+    int prix_vol = v->prix; // Pour stocker le prix du vol annulé
+    int montant_reserve = nb_places * prix_vol; // Montant total réservé
+    int penalite = (int)(montant_reserve * 0.1); // Pénalité de 10%
+    uint64_t lsn;
+    if (nb_shards > 0) {
+        ShardMsg m = { .run = shard_annuler, .v = v, .nb_places = nb_places, .agence = agence, .montant = -montant_reserve + penalite };
+        shard_call(shard_of(v), &m);
+        lsn = m.lsn;
+    } else {
+        lockVol(v, sock, cli_addr, cli_len, proto, seq);
+        lsn = vol_give_back(v, nb_places, agence, -montant_reserve + penalite);
+        pthread_mutex_unlock(vol_lock(v));
+    }
+
+    updateFacture(sock, cli_addr, agence, -montant_reserve + penalite); // Soustrait le montant réservé et ajoute la pénalité
+    journal_wait(lsn);
+    send_replyf(sock, cli_addr, cli_len, proto, seq, "ANUL", "Cancellation confirmed: %d seats on flight %d (penalty %d Dt)\n", nb_places, ref, penalite);
+    logHisto(sock, cli_addr, ref, agence, "CANCELLATION", nb_places, "OK");
+}
+
+// Book nb_places on every leg of a connecting trip, all or nothing. Legs are locked in
+// ascending reference order so two itineraries sharing flights cannot deadlock.
+void reserverItineraire(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const int *refs, int nb_refs, int nb_places, const char *agence, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Processing itinerary: %d flights, seats=%d, agency=%s", nb_refs, nb_places, agence);
+
+    Vol *legs[ITINERAIRE_MAX_LEGS];
+    int sorted[ITINERAIRE_MAX_LEGS];
+    char msg[BUFFER_SIZE];
+    const char *resultat = NULL;
+    for (int i = 0; i < nb_refs; i++) {
+        Vol *v = trouverVol(refs[i]);
+        if (!v) {
+            snprintf(msg, sizeof(msg), "Error: Flight reference %d not found\n", refs[i]);
+            resultat = "UNKNOWN";
+            break;
+        }
+        int k = i;
+        while (k > 0 && legs[k - 1]->ref > v->ref) {
+            legs[k] = legs[k - 1];
+            k--;
+        }
+        legs[k] = v;
+        if (k > 0 && legs[k - 1] == v) {
+            snprintf(msg, sizeof(msg), "Error: Flight %d appears twice in the itinerary\n", v->ref);
+            resultat = "INVALID";
+            break;
+        }
+    }
+
+    uint64_t lsn = 0;
+    int montant = 0;
+    if (!resultat) {
+        // Sharded: stop the shards of the legs, in shard order so two itineraries cannot wait
+        // on each other, then change the seats here as if holding the flight locks
+        int frozen[ITINERAIRE_MAX_LEGS], nb_frozen = 0;
+        for (int i = 0; i < nb_refs; i++) {
+            if (nb_shards > 0) {
+                int k = nb_frozen, shard = (int)(shard_of(legs[i]) - shards);
+                while (k > 0 && frozen[k - 1] > shard) {
+                    k--;
+                }
+                if (k == 0 || frozen[k - 1] != shard) {
+                    memmove(&frozen[k + 1], &frozen[k], (nb_frozen - k) * sizeof(int));
+                    frozen[k] = shard;
+                    nb_frozen++;
+                }
+            } else {
+                lockVol(legs[i], sock, cli_addr, cli_len, proto, seq);
+            }
+            sorted[i] = legs[i]->ref;
+        }
+        for (int i = 0; i < nb_frozen; i++) {
+            ShardMsg m = { .run = shard_freeze };
+            shard_call(&shards[frozen[i]], &m);
+        }
+        for (int i = 0; i < nb_refs && !resultat; i++) {
+            if (legs[i]->places < nb_places) {
+                snprintf(msg, sizeof(msg), "Error: only %d seats available on flight %d\n", legs[i]->places, legs[i]->ref);
+                resultat = "FAILED";
+            }
+        }
+        if (!resultat) {
+            for (int i = 0; i < nb_refs; i++) {
+                __atomic_store_n(&legs[i]->places, legs[i]->places - nb_places, __ATOMIC_RELAXED);
+                montant += nb_places * legs[i]->prix;
+            }
+            __atomic_add_fetch(&vols_version, 1, __ATOMIC_RELEASE);
+            lsn = journal_append_legs(sorted, nb_refs, -nb_places, agence, "OK", montant);
+        } else {
+            lsn = journal_append_legs(sorted, nb_refs, -nb_places, agence, "FAILED", 0);
+        }
+        for (int i = 0; i < nb_frozen; i++) {
+            sem_post(&shards[frozen[i]].release);
+        }
+        for (int i = nb_refs - 1; i >= 0 && nb_shards == 0; i--) {
+            pthread_mutex_unlock(vol_lock(legs[i]));
+        }
+    }
+
+    if (!resultat) {
+        updateFacture(sock, cli_addr, agence, montant);
+        journal_wait(lsn);
+        int n = snprintf(msg, sizeof(msg), "Itinerary confirmed: %d seats on flights", nb_places);
+        for (int i = 0; i < nb_refs; i++) {
+            n += snprintf(msg + n, sizeof(msg) - n, " %d", refs[i]);
+        }
+        snprintf(msg + n, sizeof(msg) - n, " (total %d Dt)\n", montant);
+        resultat = "OK";
+    } else {
+        debug_print("Itinerary rejected", cli_addr, sock);
+        metrics_failed = 1;
+    }
+    send_reply(sock, cli_addr, cli_len, proto, seq, strcmp(resultat, "OK") == 0 ? "ITIN" : "ERR", msg, strlen(msg));
+    logHistoItineraire(sock, cli_addr, refs, nb_refs, agence, nb_places, resultat);
+}
+
+// Agency names are read with %49s: a longer token is rejected rather than cut
+static int token_end(char c) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Parse "<ref> <seats> <agency>" of RESERVER and ANNULER, return 0 or -1
+int parse_booking(const char *args, int *ref, int *nb_places, char *agence) {
+    int used = 0;
+    if (sscanf(args, "%d %d %49s%n", ref, nb_places, agence, &used) != 3 || !token_end(args[used])) {
+        return -1;
+    }
+    return 0;
+}
+
+// Parse the "<agency>" of FACTURE, return 0 or -1
+int parse_agence(const char *args, char *agence) {
+    int used = 0;
+    if (sscanf(args, "%49s%n", agence, &used) != 1 || !token_end(args[used])) {
+        return -1;
+    }
+    return 0;
+}
+
+// Parse "<seats> <agency> <ref1> [<ref2> ...]", return the number of legs or -1
+int parse_itineraire(const char *args, int *nb_places, char *agence, int *refs) {
+    int used = 0, nb_refs = 0;
+    if (sscanf(args, "%d %49s%n", nb_places, agence, &used) != 2 || !token_end(args[used])) {
+        return -1;
+    }
+    args += used;
+    int ref;
+    while (sscanf(args, "%d%n", &ref, &used) == 1) {
+        if (nb_refs == ITINERAIRE_MAX_LEGS) {
+            return -1;
+        }
+        refs[nb_refs++] = ref;
+        args += used;
+    }
+    return nb_refs > 0 ? nb_refs : -1;
+}
+
+void consulterFacture(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *agence, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Fetching Facture for agency %s", agence);
+
+    size_t bucket = hash_agence(agence);
+    metrics_lock(&facture_locks[bucket % FACTURE_STRIPES], WAIT_FACTURE);
+    Facture *fa = trouverFacture(agence, bucket, 0);
+    int found = fa != NULL;
+    int montant = fa ? fa->somme : 0;
+    pthread_mutex_unlock(&facture_locks[bucket % FACTURE_STRIPES]);
+
+    if (found) {
+        send_replyf(sock, cli_addr, cli_len, proto, seq, "FACT", "Facture for %s: %d€\n", agence, montant);
+    } else {
+        debug_print("No invoice found", cli_addr, sock);
+        metrics_failed = 1;
+        send_reply(sock, cli_addr, cli_len, proto, seq, "ERR", REPLY_TEXT("No invoice found for this agency\n"));
+    }
+    debug_print("Invoice request processed", cli_addr, sock);
+}
+
+uint64_t udp_lines_version = 0; // Numbers every chunked UDP reply, a later transmission wins
+
+// Send a text reply ending with "END\n" over UDP, in numbered chunks of the given type like
+// LIST: whole lines packed into datagrams, each with a ListChunkHeader. The END line is not
+// sent, the client adds it once it holds every chunk. The version is unique to this reply,
+// so the client drops chunks left over from an earlier transmission of the request.
+void send_udp_lines(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, uint32_t seq, const char *type, const char *text, size_t len) {
+    if (len >= 4 && memcmp(text + len - 4, "END\n", 4) == 0) {
+        len -= 4; // A text cut short (full buffer) has no END, the client adds it anyway
+    }
+    size_t chunk_max = MAX_DATAGRAM_SIZE - sizeof(UdpHeader) - sizeof(ListChunkHeader);
+    uint32_t total = 0;
+    size_t off = 0;
+    do {
+        off = udp_chunk_end(text, off, len, chunk_max);
+        total++;
+    } while (off < len);
+
+    ListChunkHeader chunk = { __atomic_add_fetch(&udp_lines_version, 1, __ATOMIC_RELAXED), 0, total };
+    UdpHeader header = { seq, "", 0 };
+    strncpy(header.type, type, sizeof(header.type) - 1);
+    off = 0;
+    for (chunk.index = 0; chunk.index < total; chunk.index++) {
+        size_t end = udp_chunk_end(text, off, len, chunk_max);
+        header.len = (uint32_t)(sizeof(chunk) + end - off);
+        struct iovec iov[3] = { { &header, sizeof(header) }, { &chunk, sizeof(chunk) }, { (void *)(text + off), end - off } };
+        if (udp_sendv(sock, iov, 3, (struct sockaddr *)cli_addr, cli_len) < 0) {
+            perror("Failed to send reply via UDP");
+            return;
+        }
+        off = end;
+    }
+}
+
+void sendStats(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq) {
+    debug_print("Sending statistics", cli_addr, sock);
+    char text[4096];
+    size_t len = metrics_format(text, sizeof(text));
+    if (proto == PROTO_TCP) {
+        if (tcp_send(sock, text, len) != (ssize_t)len) {
+            perror("Failed to send statistics");
+        }
+        return;
+    }
+    send_udp_lines(sock, cli_addr, cli_len, seq, "STAT", text, len);
+}
+
+// Flights to dest (NULL for any) priced within [prix_min, prix_max] with at least places_min
+// seats left, in LIST format. Only the flights in the price range of the destination are read.
+void rechercherVols(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *dest, int prix_min, int prix_max, int places_min, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Processing search: dest=%s, price=%d-%d, seats>=%d", dest ? dest : "*", prix_min, prix_max, places_min);
+
+    const uint32_t *cand = vols_by_price;
+    size_t nb_cand = nb_vols;
+    if (dest) {
+        int d = trouverDestination(dest);
+        cand = d >= 0 ? vols_by_dest + vols_dest_first[d] : NULL;
+        nb_cand = d >= 0 ? vols_dest_first[d + 1] - vols_dest_first[d] : 0;
+    }
+    size_t lo = 0, hi = nb_cand;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (vols[cand[mid]].prix < prix_min) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t cap = BUFFER_SIZE, len = 0;
+    char *text = malloc(cap);
+    if (!text) {
+        perror("Failed to allocate search reply");
+        return;
+    }
+    len = snprintf(text, cap, "%s", vols_header);
+    for (size_t i = lo; i < nb_cand && vols[cand[i]].prix <= prix_max; i++) {
+        Vol *v = &vols[cand[i]];
+        int places = __atomic_load_n(&v->places, __ATOMIC_RELAXED);
+        if (places < places_min) {
+            continue;
+        }
+        if (len + 128 + VOL_DEST_SIZE > cap) {
+            char *tmp = realloc(text, cap *= 2);
+            if (!tmp) {
+                perror("Failed to grow search reply");
+                free(text);
+                return;
+            }
+            text = tmp;
+        }
+        len += snprintf(text + len, cap - len, "%d %s %d %d\n", v->ref, vol_dest(v), places, v->prix);
+    }
+    if (len + 5 > cap) {
+        char *tmp = realloc(text, cap = len + 5);
+        if (!tmp) {
+            free(text);
+            return;
+        }
+        text = tmp;
+    }
+    memcpy(text + len, "END\n", 4);
+    len += 4;
+
+    if (proto == PROTO_TCP) {
+        if (tcp_send(sock, text, len) != (ssize_t)len) {
+            perror("Failed to send search results");
+        }
+    } else {
+        send_udp_lines(sock, cli_addr, cli_len, seq, "SRCH", text, len);
+    }
+    free(text);
+}
+
+// Parse "<destination|*> [<min price> [<max price> [<min seats>]]]", return 0 or -1
+int parse_search(const char *args, char *dest, int *prix_min, int *prix_max, int *places_min) {
+    *prix_min = 0;
+    *prix_max = INT_MAX;
+    *places_min = 0;
+    if (sscanf(args, "%49s %d %d %d", dest, prix_min, prix_max, places_min) < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// One page of the flight list: up to size flights starting at the cursor (NULL for the first
+// page), then "NEXT <cursor>" if flights remain, then "END". Records never move while the server
+// runs, so following the cursors returns every flight exactly once whatever bookings happen in
+// between; each line shows the seats left when its page was read. The cursor holds the position
+// of the next flight and its reference, a cursor from another catalog is located by reference.
+void sendVolsPage(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *cursor, int size, Protocol proto, uint32_t seq) {
+    log_printf(LOG_DEBUG, cli_addr, sock, "Sending flight list page: cursor=%s, size=%d", cursor ? cursor : "-", size);
+
+    size_t pos = 0;
+    unsigned int ref;
+    if (cursor && (sscanf(cursor, "%zx.%x", &pos, &ref) != 2 || pos >= nb_vols || vols[pos].ref != (int)ref)) {
+        Vol *v = sscanf(cursor, "%*x.%x", &ref) == 1 ? trouverVol((int)ref) : NULL;
+        if (!v) {
+            debug_print("Invalid flight list cursor", cli_addr, sock);
+            metrics_failed = 1;
+            send_reply(sock, cli_addr, cli_len, proto, seq, "ERR", REPLY_TEXT("Error: Invalid cursor\n"));
+            return;
+        }
+        pos = v - vols;
+    }
+    if (size <= 0) {
+        size = LIST_PAGE_DEFAULT;
+    } else if (size > LIST_PAGE_MAX) {
+        size = LIST_PAGE_MAX;
+    }
+
+    // Every line fits: ref, seats and price take at most 11 characters each
+    size_t end = pos + size < nb_vols ? pos + size : nb_vols;
+    size_t cap = strlen(vols_header) + (end - pos) * (3 * 12 + VOL_DEST_SIZE) + LIST_CURSOR_SIZE + 16;
+    char *text = malloc(cap);
+    if (!text) {
+        perror("Failed to allocate flight list page");
+        return;
+    }
+    size_t len = snprintf(text, cap, "%s", vols_header);
+    for (size_t i = pos; i < end; i++) {
+        Vol *v = &vols[i];
+        len += snprintf(text + len, cap - len, "%d %s %d %d\n", v->ref, vol_dest(v), __atomic_load_n(&v->places, __ATOMIC_RELAXED), v->prix);
+    }
+    if (end < nb_vols) {
+        len += snprintf(text + len, cap - len, "NEXT %zx.%x\n", end, (unsigned int)vols[end].ref);
+    }
+    len += snprintf(text + len, cap - len, "END\n");
+
+    if (proto == PROTO_TCP) {
+        if (tcp_send(sock, text, len) != (ssize_t)len) {
+            perror("Failed to send flight list page");
+        }
+    } else {
+        send_udp_lines(sock, cli_addr, cli_len, seq, "PAGE", text, len);
+    }
+    free(text);
+}
+
+// Parse "[<cursor> [<size>]]", "-" is the first page. cursor is left empty for the first page.
+void parse_page(const char *args, char *cursor, int *size) {
+    char fmt[16];
+    cursor[0] = '\0';
+    *size = 0;
+    snprintf(fmt, sizeof(fmt), "%%%ds %%d", LIST_CURSOR_SIZE - 1);
+    sscanf(args, fmt, cursor, size);
+    if (strcmp(cursor, "-") == 0) {
+        cursor[0] = '\0';
+    }
+}
+
+// Call before executing a TCP request that carries a key. Returns 1 if the request must not
+// run: the key was seen before and the first reply has been sent again, once durable; the
+// first copy is still running, maybe for a connection that has since dropped, and
+// IN_PROGRESS_REPLY tells the client to send it again; or every slot of the table is
+// PENDING and the request gets BUSY_REPLY. Otherwise reserves a slot that tcp_key_end fills.
+int tcp_key_begin(int sock, uint64_t key) {
+    time_t now = time(NULL);
+    char text[TCP_KEY_REPLY_SIZE];
+    if (!tcp_keys.slots) {
+        return 0;
+    }
+    pthread_mutex_lock(&tcp_keys.mutex);
+    CachedReply *r = reply_cache_find(&tcp_keys, 0, 0, key, now);
+    if (!r) {
+        int full = reply_cache_insert(&tcp_keys, 0, 0, key, now) < 0;
+        pthread_mutex_unlock(&tcp_keys.mutex);
+        if (!full) {
+            return 0;
+        }
+        __atomic_fetch_add(&metrics_tcp_busy, 1, __ATOMIC_RELAXED);
+        log_printf(LOG_WARN, NULL, sock, "Request key table full of running requests, refused key=%016llx", (unsigned long long)key);
+        send_reply(sock, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT(BUSY_REPLY));
+        return 1;
+    }
+    if (r->state == REPLY_PENDING) {
+        pthread_mutex_unlock(&tcp_keys.mutex);
+        log_printf(LOG_DEBUG, NULL, sock, "Retried request key=%016llx still running", (unsigned long long)key);
+        send_reply(sock, NULL, 0, PROTO_TCP, 0, "WAIT", REPLY_TEXT(IN_PROGRESS_REPLY));
+        return 1;
+    }
+    size_t len = r->len;
+    uint64_t lsn = r->lsn;
+    memcpy(text, r->reply, len);
+    pthread_mutex_unlock(&tcp_keys.mutex);
+
+    __atomic_fetch_add(&metrics_tcp_replays, 1, __ATOMIC_RELAXED);
+    log_printf(LOG_DEBUG, NULL, sock, "Retried request key=%016llx answered from cache", (unsigned long long)key);
+    journal_wait(lsn);
+    if (tcp_send(sock, text, len) < 0) {
+        perror("Failed to send cached reply");
+    }
+    return 1;
+}
+
+// The reply is confirmed once the journal holds lsn: with deferred syncs that is the
+// batch's last record, otherwise the handler has already waited for it
+void tcp_key_end(void) {
+    reply_cache_complete(&tcp_keys, journal_defer ? journal_deferred_lsn : 0);
+}
+
+// Parse and execute one TCP command, shared by the thread-per-connection and epoll servers
+void handle_tcp_command(int newsockfd, char *buffer) {
+    log_printf(LOG_DEBUG, NULL, newsockfd, "Received command: %s", buffer);
+
+    // "ID <hex key> <command>": a retried booking with the same key is not executed again
+    uint64_t key = 0;
+    if (strncmp(buffer, "ID ", 3) == 0) {
+        char *end;
+        key = strtoull(buffer + 3, &end, 16);
+        if (end == buffer + 3 || *end != ' ' || key == 0) {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid request key\n"));
+            debug_print("Invalid request key", NULL, newsockfd);
+            return;
+        }
+        buffer = end + 1;
+    }
+    if (strncmp(buffer, "STATS", 5) == 0) {
+        sendStats(newsockfd, NULL, 0, PROTO_TCP, 0);
+        return;
+    }
+    MetricCmd cmd = metrics_command(buffer);
+    uint64_t start = metrics_now_ns();
+    int once = key && (cmd == METRIC_RESERVER || cmd == METRIC_ANNULER || cmd == METRIC_ITINERAIRE);
+    if (once && tcp_key_begin(newsockfd, key)) {
+        metrics_record(cmd, start);
+        return;
+    }
+    if (strncmp(buffer, "LIST", 4) == 0) {
+        sendVols(newsockfd, NULL, 0, PROTO_TCP, 0);
+    } else if (strncmp(buffer, "PAGE", 4) == 0) {
+        char cursor[LIST_CURSOR_SIZE];
+        int size;
+        parse_page(buffer + 4, cursor, &size);
+        sendVolsPage(newsockfd, NULL, 0, cursor[0] ? cursor : NULL, size, PROTO_TCP, 0);
+    } else if (strncmp(buffer, "RESERVER", 8) == 0) {
+        int ref, nb;
+        char agence[50];
+        if (parse_booking(buffer + 9, &ref, &nb, agence) == 0) {
+            reserverVol(newsockfd, NULL, 0, ref, nb, agence, PROTO_TCP, 0);
+        } else {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid RESERVER command\n"));
+            debug_print("Invalid RESERVER command", NULL, newsockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(buffer, "ANNULER", 7) == 0) {
+        int ref, nb;
+        char agence[50];
+        if (parse_booking(buffer + 8, &ref, &nb, agence) == 0) {
+            annulerVol(newsockfd, NULL, 0, ref, nb, agence, PROTO_TCP, 0);
+        } else {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid ANNULER command\n"));
+            debug_print("Invalid ANNULER command", NULL, newsockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(buffer, "ITINERAIRE", 10) == 0) {
+        int nb, refs[ITINERAIRE_MAX_LEGS];
+        char agence[50];
+        int nb_refs = parse_itineraire(buffer + 10, &nb, agence, refs);
+        if (nb_refs > 0) {
+            reserverItineraire(newsockfd, NULL, 0, refs, nb_refs, nb, agence, PROTO_TCP, 0);
+        } else {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid ITINERAIRE command\n"));
+            debug_print("Invalid ITINERAIRE command", NULL, newsockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(buffer, "SEARCH", 6) == 0) {
+        char dest[VOL_DEST_SIZE];
+        int prix_min, prix_max, places_min;
+        if (parse_search(buffer + 6, dest, &prix_min, &prix_max, &places_min) == 0) {
+            rechercherVols(newsockfd, NULL, 0, strcmp(dest, "*") == 0 ? NULL : dest, prix_min, prix_max, places_min, PROTO_TCP, 0);
+        } else {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid SEARCH command\n"));
+            debug_print("Invalid SEARCH command", NULL, newsockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(buffer, "FACTURE", 7) == 0) {
+        char ag[50];
+        if (parse_agence(buffer + 8, ag) == 0) {
+            consulterFacture(newsockfd, NULL, 0, ag, PROTO_TCP, 0);
+        } else {
+            send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid FACTURE command\n"));
+            debug_print("Invalid FACTURE command", NULL, newsockfd);
+            metrics_failed = 1;
         }
+    } else {
+        send_reply(newsockfd, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Unknown command\n"));
+        debug_print("Unknown command received", NULL, newsockfd);
+        metrics_failed = 1;
     }
-    if (!found) {
-        fprintf(tmp, "%s %d\n", agence, montant);
-    }
-
-    fclose(f);
-    fclose(tmp);
-    if (remove(FACTURE_FILE) != 0 || rename("temp_facture.txt", FACTURE_FILE) != 0) {
-        perror("Failed to update invoice file");
+    if (once) {
+        tcp_key_end();
     }
-    debug_print("Invoice updated successfully", cli_addr, sock);
-    pthread_mutex_unlock(&facture_mutex);
+    metrics_record(cmd, start);
 }
 
-void sendVols(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, Protocol proto, uint32_t seq) {
-    debug_print("Sending flight list", cli_addr, sock);
-    if (pthread_mutex_trylock(&vols_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "flight list", proto, seq);
-        pthread_mutex_lock(&vols_mutex);
+// Copy the agency name of a frame body, rejecting names the text files could not store
+int frame_agence(const char *body, size_t len, char *agence, size_t size) {
+    if (len == 0 || len >= size) {
+        return -1;
     }
-    FILE *f = fopen(VOL_FILE, "r");
-    if (!f) {
-        char err[] = "Error: Unable to open flights file\n";
-        debug_print("Failed to open flights file", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            write(sock, err, strlen(err));
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+    for (size_t i = 0; i < len; i++) {
+        if (body[i] == '\0' || body[i] == ' ' || body[i] == '\n' || body[i] == '\t') {
+            return -1;
         }
-        pthread_mutex_unlock(&vols_mutex);
-        return;
     }
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), f)) {
-        if (proto == PROTO_TCP) {
-            if (write(sock, line, strlen(line)) < 0) {
-                perror("Failed to send flight line");
-                fclose(f);
-                pthread_mutex_unlock(&vols_mutex);
+    memcpy(agence, body, len);
+    agence[len] = '\0';
+    return 0;
+}
+
+// Execute one binary request, its reply text goes to the capture buffer through tcp_send
+void handle_tcp_frame(int sock, uint8_t opcode, const char *body, size_t len) {
+    char agence[50];
+    uint32_t ref, nb;
+    switch (opcode) {
+        case OP_LIST:
+            sendVols(sock, NULL, 0, PROTO_TCP, 0);
+            return;
+        case OP_STATS:
+            sendStats(sock, NULL, 0, PROTO_TCP, 0);
+            return;
+        case OP_RESERVER:
+        case OP_ANNULER:
+            if (len > 8 && frame_agence(body + 8, len - 8, agence, sizeof(agence)) == 0) {
+                memcpy(&ref, body, 4);
+                memcpy(&nb, body + 4, 4);
+                if (opcode == OP_RESERVER) {
+                    reserverVol(sock, NULL, 0, (int)ntohl(ref), (int)ntohl(nb), agence, PROTO_TCP, 0);
+                } else {
+                    annulerVol(sock, NULL, 0, (int)ntohl(ref), (int)ntohl(nb), agence, PROTO_TCP, 0);
+                }
                 return;
             }
-        } else {
-            UdpHeader header = { seq, "LIST", (uint32_t)strlen(line) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), line, strlen(line));
-            if (sendto(sock, packet, sizeof(UdpHeader) + strlen(line), 0, (struct sockaddr *)cli_addr, cli_len) < 0) {
-                perror("Failed to send flight line via UDP");
-                fclose(f);
-                pthread_mutex_unlock(&vols_mutex);
+            break;
+        case OP_ITINERAIRE: {
+            uint32_t nb_refs, leg;
+            int refs[ITINERAIRE_MAX_LEGS];
+            if (len < 8) {
+                break;
+            }
+            memcpy(&nb, body, 4);
+            memcpy(&nb_refs, body + 4, 4);
+            nb_refs = ntohl(nb_refs);
+            if (nb_refs == 0 || nb_refs > ITINERAIRE_MAX_LEGS || len <= 8 + 4 * nb_refs ||
+                frame_agence(body + 8 + 4 * nb_refs, len - 8 - 4 * nb_refs, agence, sizeof(agence)) != 0) {
+                break;
+            }
+            for (uint32_t i = 0; i < nb_refs; i++) {
+                memcpy(&leg, body + 8 + 4 * i, 4);
+                refs[i] = (int)ntohl(leg);
+            }
+            reserverItineraire(sock, NULL, 0, refs, (int)nb_refs, (int)ntohl(nb), agence, PROTO_TCP, 0);
+            return;
+        }
+        case OP_FACTURE:
+            if (frame_agence(body, len, agence, sizeof(agence)) == 0) {
+                consulterFacture(sock, NULL, 0, agence, PROTO_TCP, 0);
                 return;
             }
+            break;
+        case OP_SEARCH: {
+            // Same character rules as agency names, an empty destination matches any
+            char dest[VOL_DEST_SIZE];
+            uint32_t bounds[3];
+            if (len < 12 || (len > 12 && frame_agence(body + 12, len - 12, dest, sizeof(dest)) != 0)) {
+                break;
+            }
+            memcpy(bounds, body, 12);
+            rechercherVols(sock, NULL, 0, len > 12 ? dest : NULL, (int)ntohl(bounds[0]), (int)ntohl(bounds[1]),
+                           (int)ntohl(bounds[2]), PROTO_TCP, 0);
+            return;
         }
-    }
-    char end[] = "END\n";
-    if (proto == PROTO_TCP) {
-        if (write(sock, end, strlen(end)) != strlen(end)) {
-            perror("Failed to send END marker");
+        case OP_PAGE: {
+            char cursor[LIST_CURSOR_SIZE];
+            uint32_t size;
+            if (len < 4 || (len > 4 && frame_agence(body + 4, len - 4, cursor, sizeof(cursor)) != 0)) {
+                break;
+            }
+            memcpy(&size, body, 4);
+            sendVolsPage(sock, NULL, 0, len > 4 ? cursor : NULL, (int)ntohl(size), PROTO_TCP, 0);
+            return;
         }
-    } else {
-        UdpHeader header = { seq, "END", (uint32_t)strlen(end) };
-        char packet[MAX_DATAGRAM_SIZE];
-        memcpy(packet, &header, sizeof(UdpHeader));
-        memcpy(packet + sizeof(UdpHeader), end, strlen(end));
-        if (sendto(sock, packet, sizeof(UdpHeader) + strlen(end), 0, (struct sockaddr *)cli_addr, cli_len) < 0) {
-            perror("Failed to send END marker via UDP");
+        default: {
+            send_reply(sock, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Unknown command\n"));
+            debug_print("Unknown frame opcode received", NULL, sock);
+            metrics_failed = 1;
+            return;
         }
     }
-    debug_print("Flight list sent successfully", cli_addr, sock);
-    fclose(f);
-    pthread_mutex_unlock(&vols_mutex);
+    send_reply(sock, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT("Invalid command\n"));
+    debug_print("Invalid frame received", NULL, sock);
+    metrics_failed = 1;
 }
 
-void reserverVol(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, int ref, int nb_places, const char *agence, Protocol proto, uint32_t seq) {
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Processing reservation: ref=%d, seats=%d, agency=%s", ref, nb_places, agence);
-    debug_print(debug_msg, cli_addr, sock);
-    
-    if (pthread_mutex_trylock(&vols_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "flight list", proto, seq);
-        pthread_mutex_lock(&vols_mutex);
-    }
-    FILE *f = fopen(VOL_FILE, "r");
-    FILE *tmp = fopen("temp.txt", "w");
-    char line[BUFFER_SIZE];
-    int trouvé = 0;
+__thread int tcp_busy = 0; // Set while the epoll loop answers requests itself because no worker can take them
 
-    if (!f || !tmp) {
-        char err[] = "Error: Unable to access flights file\n";
-        debug_print("Failed to access flights file", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            write(sock, err, strlen(err));
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
-        }
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        pthread_mutex_unlock(&vols_mutex);
-        return;
+// Execute every complete request in buf and return the number of bytes consumed,
+// or -1 on a malformed frame. Text commands keep the one-read-one-command rule;
+// binary frames can be pipelined and split across reads, the caller keeps the rest.
+// With tcp_busy set each request only gets BUSY_REPLY.
+ssize_t handle_tcp_input(int sock, char *buf, size_t len) {
+    if (len == 0) {
+        return 0;
     }
-
-    while (fgets(line, sizeof(line), f)) {
-        int r, places, prix;
-        char dest[50];
-        if (sscanf(line, "%d %s %d %d", &r, dest, &places, &prix) == 4) {
-            if (r == ref) {
-                trouvé = 1;
-                if (places >= nb_places) {
-                    places -= nb_places;
-                    fprintf(tmp, "%d %s %d %d\n", r, dest, places, prix);
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, sizeof(msg), "Reservation confirmed: %d seats on flight %d\n", nb_places, ref);
-                    if (proto == PROTO_TCP) {
-                        if (write(sock, msg, strlen(msg)) < 0) {
-                            perror("Failed to send confirmation");
-                        }
-                    } else {
-                        UdpHeader header = { seq, "RSRV", (uint32_t)strlen(msg) };
-                        char packet[MAX_DATAGRAM_SIZE];
-                        memcpy(packet, &header, sizeof(UdpHeader));
-                        memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-                        sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-                    }
-                    logHisto(sock, cli_addr, cli_len, ref, agence, "RESERVATION", nb_places, "OK", proto, seq);
-                    updateFacture(sock, cli_addr, cli_len, agence, nb_places * prix, proto, seq);
-                } else {
-                    fprintf(tmp, "%s", line);
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, sizeof(msg), "Error: only %d seats available\n", places);
-                    if (proto == PROTO_TCP) {
-                        if (write(sock, msg, strlen(msg)) < 0) {
-                            perror("Failed to send error message");
-                        }
-                    } else {
-                        UdpHeader header = { seq, "ERR", (uint32_t)strlen(msg) };
-                        char packet[MAX_DATAGRAM_SIZE];
-                        memcpy(packet, &header, sizeof(UdpHeader));
-                        memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-                        sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-                    }
-                    logHisto(sock, cli_addr, cli_len, ref, agence, "RESERVATION", nb_places, "FAILED", proto, seq);
-                }
-            } else {
-                fprintf(tmp, "%s", line);
-            }
+    if ((unsigned char)buf[0] != (FRAME_MAGIC >> 8)) {
+        buf[len] = '\0';
+        if (tcp_busy) {
+            send_reply(sock, NULL, 0, PROTO_TCP, 0, "ERR", REPLY_TEXT(BUSY_REPLY));
+            __atomic_fetch_add(&metrics_tcp_busy, 1, __ATOMIC_RELAXED);
         } else {
-            fprintf(tmp, "%s", line);
+            handle_tcp_command(sock, buf);
         }
+        return len;
     }
 
-    fclose(f);
-    fclose(tmp);
-    if (!trouvé) {
-        char msg[] = "Error: Flight reference not found\n";
-        debug_print("Flight reference not found", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            if (write(sock, msg, strlen(msg)) < 0) {
-                perror("Failed to send error message");
+    FrameCapture cap = { sock, NULL, 0, 0 };
+    ssize_t used = 0;
+    // Frame latencies are recorded once their replies leave, after the shared journal wait
+    MetricCmd cmds[BUFFER_SIZE / sizeof(FrameHeader)];
+    uint64_t starts[BUFFER_SIZE / sizeof(FrameHeader)];
+    char failed[BUFFER_SIZE / sizeof(FrameHeader)];
+    size_t nb_frames = 0;
+    tcp_capture = &cap;
+    journal_defer = 1;
+    while (len - used >= sizeof(FrameHeader)) {
+        FrameHeader h;
+        memcpy(&h, buf + used, sizeof(h));
+        uint32_t body_len = ntohl(h.len);
+        if (ntohs(h.magic) != FRAME_MAGIC || body_len > FRAME_MAX_BODY) {
+            log_printf(LOG_WARN, NULL, sock, "Malformed frame, closing connection");
+            used = -1;
+            break;
+        }
+        if (len - used < sizeof(h) + body_len) {
+            break; // Rest of the frame is still in flight
+        }
+        size_t reply_off = cap.len;
+        if (capture_append(&cap, &h, sizeof(h)) < 0) {
+            used = -1;
+            break;
+        }
+        uint64_t start = metrics_now_ns();
+        const char *body = buf + used + sizeof(h);
+        size_t body_left = body_len;
+        uint64_t key = 0;
+        if ((h.flags & FRAME_FLAG_KEY) && body_left >= 8) {
+            uint32_t half[2];
+            memcpy(half, body, 8);
+            key = (uint64_t)ntohl(half[0]) << 32 | ntohl(half[1]);
+            body += 8;
+            body_left -= 8;
+        }
+        int once = key && (h.opcode == OP_RESERVER || h.opcode == OP_ANNULER || h.opcode == OP_ITINERAIRE);
+        if (tcp_busy) {
+            capture_append(&cap, REPLY_TEXT(BUSY_REPLY));
+            __atomic_fetch_add(&metrics_tcp_busy, 1, __ATOMIC_RELAXED);
+        } else if (!once || !tcp_key_begin(sock, key)) {
+            handle_tcp_frame(sock, h.opcode, body, body_left);
+            if (once) {
+                tcp_key_end();
             }
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(msg) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-        }
-        remove("temp.txt");
-        logHisto(sock, cli_addr, cli_len, ref, agence, "RESERVATION", nb_places, "UNKNOWN", proto, seq);
-    } else {
-        if (remove(VOL_FILE) != 0 || rename("temp.txt", VOL_FILE) != 0) {
-            perror("Failed to update flights file");
         }
-        debug_print("Flights file updated successfully", cli_addr, sock);
+        if (!tcp_busy && h.opcode != OP_STATS && nb_frames < sizeof(cmds) / sizeof(cmds[0])) {
+            cmds[nb_frames] = metrics_opcode(h.opcode);
+            starts[nb_frames] = start;
+            failed[nb_frames++] = metrics_failed;
+        }
+        metrics_failed = 0;
+        h.len = htonl(cap.len - reply_off - sizeof(h));
+        memcpy(cap.buf + reply_off, &h, sizeof(h));
+        used += sizeof(h) + body_len;
     }
-    pthread_mutex_unlock(&vols_mutex);
-}
+    tcp_capture = NULL;
+    journal_defer = 0;
 
-void annulerVol(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, int ref, int nb_places, const char *agence, Protocol proto, uint32_t seq) {
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Processing cancellation: ref=%d, seats=%d, agency=%s", ref, nb_places, agence);
-    debug_print(debug_msg, cli_addr, sock);
-    
-    if (pthread_mutex_trylock(&vols_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "flight list", proto, seq);
-        pthread_mutex_lock(&vols_mutex);
+    // One fsync wait and one send for the whole pipeline
+    journal_wait(journal_deferred_lsn);
+    journal_deferred_lsn = 0;
+    if (cap.len > 0 && tcp_send(sock, cap.buf, cap.len) < 0) {
+        perror("Failed to send frame replies");
     }
-    FILE *f = fopen(VOL_FILE, "r");
-    FILE *tmp = fopen("temp.txt", "w");
-    char line[BUFFER_SIZE];
-    int trouvé = 0;
-    int prix_vol = 0; // Pour stocker le prix du vol annulé
-
-    if (!f || !tmp) {
-        char err[] = "Error: Unable to access flights file\n";
-        debug_print("Failed to access flights file", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            write(sock, err, strlen(err));
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
-        }
-        if (f) fclose(f);
-        if (tmp) fclose(tmp);
-        pthread_mutex_unlock(&vols_mutex);
-        return;
+    free(cap.buf);
+    for (size_t i = 0; i < nb_frames; i++) {
+        metrics_failed = failed[i];
+        metrics_record(cmds[i], starts[i]);
     }
+    return used;
+}
 
-    while (fgets(line, sizeof(line), f)) {
-        int r, places, prix;
-        char dest[50];
-        if (sscanf(line, "%d %s %d %d", &r, dest, &places, &prix) == 4) {
-            if (r == ref) {
-                trouvé = 0;
-                if (places >= 0) { // Vérifie que les places sont valides après annulation
-                    trouvé = 1;
-                    places += nb_places;
-                    prix_vol = prix; // Stocke le prix par siège
-                    fprintf(tmp, "%d %s %d %d\n", r, dest, places, prix);
-                    int montant_reserve = nb_places * prix; // Montant total réservé
-                    int penalite = (int)(montant_reserve * 0.1); // Pénalité de 10%
-                    updateFacture(sock, cli_addr, cli_len, agence, -montant_reserve + penalite, proto, seq); // Soustrait le montant réservé et ajoute la pénalité
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, sizeof(msg), "Cancellation confirmed: %d seats on flight %d (penalty %d Dt)\n", nb_places, ref, penalite);
-                    if (proto == PROTO_TCP) {
-                        if (write(sock, msg, strlen(msg)) < 0) {
-                            perror("Failed to send cancellation confirmation");
-                        }
-                    } else {
-                        UdpHeader header = { seq, "ANUL", (uint32_t)strlen(msg) };
-                        char packet[MAX_DATAGRAM_SIZE];
-                        memcpy(packet, &header, sizeof(UdpHeader));
-                        memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-                        sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-                    }
-                    logHisto(sock, cli_addr, cli_len, ref, agence, "CANCELLATION", nb_places, "OK", proto, seq);
-                } else {
-                    fprintf(tmp, "%s", line);
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, sizeof(msg), "Error: Invalid number of seats for cancellation\n");
-                    if (proto == PROTO_TCP) {
-                        if (write(sock, msg, strlen(msg)) < 0) {
-                            perror("Failed to send error message");
-                        }
-                    } else {
-                        UdpHeader header = { seq, "ERR", (uint32_t)strlen(msg) };
-                        char packet[MAX_DATAGRAM_SIZE];
-                        memcpy(packet, &header, sizeof(UdpHeader));
-                        memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-                        sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-                    }
-                    logHisto(sock, cli_addr, cli_len, ref, agence, "CANCELLATION", nb_places, "FAILED", proto, seq);
-                }
-            } else {
-                fprintf(tmp, "%s", line);
-            }
-        } else {
-            fprintf(tmp, "%s", line);
-        }
-    }
+// Limits of the TCP server, from the environment at startup
+int tcp_workers = EPOLL_WORKERS;
+size_t tcp_queue_size = TCP_QUEUE_SIZE;
+size_t tcp_max_clients = TCP_MAX_CLIENTS;
+size_t tcp_clients = 0;    // Open connections, in both TCP modes
 
-    fclose(f);
-    fclose(tmp);
-    if (!trouvé) {
-        char msg[] = "Error: Flight reference not found\n";
-        debug_print("Flight reference not found", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            if (write(sock, msg, strlen(msg)) < 0) {
-                perror("Failed to send error message");
-            }
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(msg) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-        }
-        remove("temp.txt");
-        logHisto(sock, cli_addr, cli_len, ref, agence, "CANCELLATION", nb_places, "UNKNOWN", proto, seq);
-    } else {
-        if (remove(VOL_FILE) != 0 || rename("temp.txt", VOL_FILE) != 0) {
-            perror("Failed to update flights file");
-        }
-        debug_print("Flights file updated successfully", cli_addr, sock);
+size_t env_size(const char *name, size_t def) {
+    const char *env = getenv(name);
+    char *end;
+    unsigned long long v = env ? strtoull(env, &end, 10) : 0;
+    if (env && (*end != '\0' || v == 0)) {
+        log_printf(LOG_WARN, NULL, -1, "Ignoring invalid %s=%s", name, env);
     }
-    pthread_mutex_unlock(&vols_mutex);
+    return env && *end == '\0' && v > 0 ? (size_t)v : def;
 }
 
-void consulterFacture(int sock, struct sockaddr_in *cli_addr, socklen_t cli_len, const char *agence, Protocol proto, uint32_t seq) {
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Fetching Facture for agency %s", agence);
-    debug_print(debug_msg, cli_addr, sock);
-    
-    if (pthread_mutex_trylock(&facture_mutex) != 0) {
-        send_wait_message(sock, cli_addr, cli_len, "invoice file", proto, seq);
-        pthread_mutex_lock(&facture_mutex);
-    }
-    FILE *f = fopen(FACTURE_FILE, "r");
-    int found = 0;
-    if (f) {
-        char line[BUFFER_SIZE];
-        while (fgets(line, sizeof(line), f)) {
-            char ag[50];
-            int montant;
-            if (sscanf(line, "%s %d", ag, &montant) == 2 && strcmp(ag, agence) == 0) {
-                char msg[BUFFER_SIZE];
-                snprintf(msg, sizeof(msg), "Facture for %s: %d€\n", agence, montant);
-                if (proto == PROTO_TCP) {
-                    if (write(sock, msg, strlen(msg)) < 0) {
-                        perror("Failed to send Facture");
-                    }
-                } else {
-                    UdpHeader header = { seq, "FACT", (uint32_t)strlen(msg) };
-                    char packet[MAX_DATAGRAM_SIZE];
-                    memcpy(packet, &header, sizeof(UdpHeader));
-                    memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-                    sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-                }
-                found = 1;
-                break;
-            }
-        }
-        fclose(f);
-    }
-    if (!found) {
-        char msg[] = "No invoice found for this agency\n";
-        debug_print("No invoice found", cli_addr, sock);
-        if (proto == PROTO_TCP) {
-            if (write(sock, msg, strlen(msg)) < 0) {
-                perror("Failed to send no-invoice message");
-            }
-        } else {
-            UdpHeader header = { seq, "ERR", (uint32_t)strlen(msg) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), msg, strlen(msg));
-            sendto(sock, packet, sizeof(UdpHeader) + strlen(msg), 0, (struct sockaddr *)cli_addr, cli_len);
-        }
+// Count a new connection, or turn it away with BUSY_REPLY once tcp_max_clients are open
+int tcp_client_admit(int fd, struct sockaddr_in *cli_addr) {
+    if (__atomic_add_fetch(&tcp_clients, 1, __ATOMIC_RELAXED) <= tcp_max_clients) {
+        return 0;
     }
-    debug_print("Invoice request processed", cli_addr, sock);
-    pthread_mutex_unlock(&facture_mutex);
+    __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics_tcp_busy, 1, __ATOMIC_RELAXED);
+    send(fd, BUSY_REPLY, strlen(BUSY_REPLY), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    log_printf(LOG_INFO, cli_addr, fd, "Too many clients, connection refused");
+    return -1;
 }
 
 // Thread function for TCP clients
 void *handle_tcp_client(void *arg) {
-    int newsockfd = *(int *)arg;
-    free(arg);
+    int newsockfd = (int)(intptr_t)arg;
     char buffer[BUFFER_SIZE];
+    size_t buffered = 0; // Start of a binary frame still waiting for its end
     
     debug_print("New TCP client thread started", NULL, newsockfd);
 
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        ssize_t n = read(newsockfd, buffer, BUFFER_SIZE - 1);
+        ssize_t n = read(newsockfd, buffer + buffered, BUFFER_SIZE - 1 - buffered);
         if (n < 0) {
             perror("Error reading from client");
             break;
         }
         if (n == 0) {
-            debug_print("Client disconnected", NULL, newsockfd);
+            log_printf(LOG_INFO, NULL, newsockfd, "Client disconnected");
             break;
         }
-        buffer[n] = '\0';
-        char debug_msg[BUFFER_SIZE];
-        snprintf(debug_msg, sizeof(debug_msg), "Received command: %s", buffer);
-        debug_print(debug_msg, NULL, newsockfd);
-
-        if (strncmp(buffer, "LIST", 4) == 0) {
-            sendVols(newsockfd, NULL, 0, PROTO_TCP, 0);
-        } else if (strncmp(buffer, "RESERVER", 8) == 0) {
-            int ref, nb;
-            char agence[50];
-            if (sscanf(buffer + 9, "%d %d %s", &ref, &nb, agence) == 3) {
-                reserverVol(newsockfd, NULL, 0, ref, nb, agence, PROTO_TCP, 0);
-            } else {
-                char err[] = "Invalid RESERVER command\n";
-                write(newsockfd, err, strlen(err));
-                debug_print("Invalid RESERVER command", NULL, newsockfd);
-            }
-        } else if (strncmp(buffer, "ANNULER", 7) == 0) {
-            int ref, nb;
-            char agence[50];
-            if (sscanf(buffer + 8, "%d %d %s", &ref, &nb, agence) == 3) {
-                annulerVol(newsockfd, NULL, 0, ref, nb, agence, PROTO_TCP, 0);
-            } else {
-                char err[] = "Invalid ANNULER command\n";
-                write(newsockfd, err, strlen(err));
-                debug_print("Invalid ANNULER command", NULL, newsockfd);
-            }
-        } else if (strncmp(buffer, "FACTURE", 7) == 0) {
-            char ag[50];
-            if (sscanf(buffer + 8, "%s", ag) == 1) {
-                consulterFacture(newsockfd, NULL, 0, ag, PROTO_TCP, 0);
-            } else {
-                char err[] = "Invalid FACTURE command\n";
-                write(newsockfd, err, strlen(err));
-                debug_print("Invalid FACTURE command", NULL, newsockfd);
-            }
-        } else {
-            char err[] = "Unknown command\n";
-            write(newsockfd, err, strlen(err));
-            debug_print("Unknown command received", NULL, newsockfd);
+        buffered += n;
+        ssize_t used = handle_tcp_input(newsockfd, buffer, buffered);
+        if (used < 0) {
+            break;
         }
+        buffered -= used;
+        memmove(buffer, buffer + used, buffered);
     }
 
     close(newsockfd);
+    __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
     debug_print("TCP client thread terminated", NULL, newsockfd);
     return NULL;
 }
 
+// Event-driven TCP server: one epoll loop accepts and watches every connection,
+// a fixed pool of workers reads commands and runs them
+int epoll_fd = -1;
+
+// Bounded lock-free queue of connections with pending events, each queued at most once
+// (EPOLLONESHOT). Any thread may push or pop: a cell holds the position it can next be
+// written at, or that position + 1 once written. Workers sleep on a count of queued cells.
+typedef struct {
+    size_t seq;
+    Conn *c;
+} ReadyCell;
+
+ReadyCell *epoll_ready = NULL;
+size_t epoll_ready_mask = 0;
+size_t epoll_ready_tail __attribute__((aligned(64))) = 0; // Next position to write
+size_t epoll_ready_head __attribute__((aligned(64))) = 0; // Next position to read
+sem_t epoll_ready_sem;
+
+// Returns -1 when the queue is full
+int epoll_ready_push(Conn *c) {
+    size_t pos = __atomic_load_n(&epoll_ready_tail, __ATOMIC_RELAXED);
+    while (1) {
+        ReadyCell *cell = &epoll_ready[pos & epoll_ready_mask];
+        intptr_t diff = (intptr_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff < 0) {
+            return -1; // Still holds the entry from one lap ago
+        }
+        if (diff > 0) {
+            pos = __atomic_load_n(&epoll_ready_tail, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&epoll_ready_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            cell->c = c;
+            __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+            sem_post(&epoll_ready_sem);
+            return 0;
+        }
+    }
+}
+
+Conn *epoll_ready_pop(void) {
+    while (sem_wait(&epoll_ready_sem) < 0 && errno == EINTR) {
+    }
+    size_t pos = __atomic_load_n(&epoll_ready_head, __ATOMIC_RELAXED);
+    while (1) {
+        ReadyCell *cell = &epoll_ready[pos & epoll_ready_mask];
+        intptr_t diff = (intptr_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff < 0) {
+            sched_yield(); // Counted, but an earlier push is still filling its cell
+            pos = __atomic_load_n(&epoll_ready_head, __ATOMIC_RELAXED);
+        } else if (diff > 0) {
+            pos = __atomic_load_n(&epoll_ready_head, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&epoll_ready_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            Conn *c = cell->c;
+            __atomic_store_n(&cell->seq, pos + epoll_ready_mask + 1, __ATOMIC_RELEASE);
+            return c;
+        }
+    }
+}
+
+void conn_close(Conn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    epoll_conns[c->fd] = NULL;
+    close(c->fd);
+    __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
+    log_printf(LOG_INFO, NULL, c->fd, "Client disconnected");
+    free(c->wbuf);
+    free(c);
+}
+
+// Re-arm the connection, only waiting for output while the client lags behind
+void conn_rearm(Conn *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    ev.events |= c->wlen > EPOLL_MAX_PENDING_OUTPUT ? 0 : EPOLLIN;
+    ev.events |= c->wlen > 0 ? EPOLLOUT : 0;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("Failed to re-arm client connection");
+        conn_close(c);
+    }
+}
+
+// Read the pending requests of a connection and run them, or with tcp_busy set answer them
+// with BUSY_REPLY. Returns -1 when the connection must be closed.
+int conn_serve(Conn *c) {
+    if ((c->events & EPOLLOUT) && conn_flush(c) < 0) {
+        return -1;
+    }
+    if (!(c->events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return 0;
+    }
+    for (int i = 0; i < EPOLL_MAX_READS && c->wlen <= EPOLL_MAX_PENDING_OUTPUT; i++) {
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, BUFFER_SIZE - 1 - c->rlen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        c->rlen += n;
+        ssize_t used = handle_tcp_input(c->fd, c->rbuf, c->rlen);
+        if (used < 0) {
+            return -1;
+        }
+        c->rlen -= used;
+        memmove(c->rbuf, c->rbuf + used, c->rlen);
+    }
+    return 0;
+}
+
+void *epoll_worker_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        Conn *c = epoll_ready_pop();
+        if (conn_serve(c) < 0) {
+            conn_close(c);
+        } else {
+            conn_rearm(c);
+        }
+    }
+    return NULL;
+}
+
+int run_epoll_server(int sockfd) {
+    struct rlimit rl;
+    epoll_max_fds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur : 65536;
+    epoll_conns = calloc(epoll_max_fds, sizeof(Conn *));
+    size_t queue_size = 2; // With one cell a written cell would look free to the next push
+    while (queue_size < tcp_queue_size) {
+        queue_size *= 2;
+    }
+    epoll_ready = calloc(queue_size, sizeof(ReadyCell));
+    epoll_fd = epoll_create1(0);
+    if (!epoll_conns || !epoll_ready || epoll_fd < 0 || sem_init(&epoll_ready_sem, 0, 0) < 0) {
+        perror("Failed to initialize epoll server");
+        return -1;
+    }
+    epoll_ready_mask = queue_size - 1;
+    for (size_t i = 0; i < queue_size; i++) {
+        epoll_ready[i].seq = i;
+    }
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("Failed to make listening socket non-blocking");
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        perror("Failed to watch listening socket");
+        return -1;
+    }
+
+    for (int i = 0; i < tcp_workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, epoll_worker_thread, NULL) != 0) {
+            perror("Failed to create epoll worker");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error in epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (c) {
+                c->events = events[i].events;
+                if (epoll_ready_push(c) == 0) {
+                    continue;
+                }
+                // Every worker is behind: answer the requests here instead of queueing more work
+                tcp_busy = 1;
+                int failed = conn_serve(c);
+                tcp_busy = 0;
+                if (failed < 0) {
+                    conn_close(c);
+                } else {
+                    conn_rearm(c);
+                }
+                continue;
+            }
+            // Accept every pending connection on the listening socket
+            while (1) {
+                struct sockaddr_in cli_addr;
+                socklen_t clilen = sizeof(cli_addr);
+                int fd = accept4(sockfd, (struct sockaddr *)&cli_addr, &clilen, SOCK_NONBLOCK);
+                if (fd < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("Failed to accept client connection");
+                    }
+                    break;
+                }
+                if (tcp_client_admit(fd, &cli_addr) < 0) {
+                    continue;
+                }
+                Conn *nc = (size_t)fd < epoll_max_fds ? calloc(1, sizeof(Conn)) : NULL;
+                if (!nc) {
+                    perror("Failed to allocate client connection");
+                    close(fd);
+                    __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                nc->fd = fd;
+                epoll_conns[fd] = nc;
+                struct epoll_event cev;
+                cev.events = EPOLLIN | EPOLLONESHOT;
+                cev.data.ptr = nc;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev) < 0) {
+                    perror("Failed to watch client connection");
+                    epoll_conns[fd] = NULL;
+                    close(fd);
+                    __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
+                    free(nc);
+                    continue;
+                }
+                log_printf(LOG_INFO, &cli_addr, fd, "New client connected");
+            }
+        }
+    }
+}
+
 void handle_udp_request(int sockfd, char *buffer, ssize_t n, struct sockaddr_in *cli_addr, socklen_t cli_len) {
     if (n < sizeof(UdpHeader)) {
-        char err[] = "Datagram too short\n";
-        UdpHeader header = { 0, "ERR", (uint32_t)strlen(err) };
-        char packet[MAX_DATAGRAM_SIZE];
-        memcpy(packet, &header, sizeof(UdpHeader));
-        memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-        sendto(sockfd, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+        send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, 0, "ERR", REPLY_TEXT("Datagram too short\n"));
         debug_print("Received invalid datagram: too short", cli_addr, sockfd);
         return;
     }
@@ -571,72 +3504,258 @@ void handle_udp_request(int sockfd, char *buffer, ssize_t n, struct sockaddr_in
     UdpHeader header;
     memcpy(&header, buffer, sizeof(UdpHeader));
     char *payload = buffer + sizeof(UdpHeader);
+    if (header.len > n - sizeof(UdpHeader)) {
+        header.len = n - sizeof(UdpHeader);
+    }
     payload[header.len] = '\0';
 
-    char debug_msg[BUFFER_SIZE];
-    snprintf(debug_msg, sizeof(debug_msg), "Received UDP command: %s", payload);
-    debug_print(debug_msg, cli_addr, sockfd);
+    log_printf(LOG_DEBUG, cli_addr, sockfd, "Received UDP command: %s", payload);
 
+    if (strncmp(payload, "STATS", 5) == 0) {
+        sendStats(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq);
+        return;
+    }
+    MetricCmd cmd = metrics_command(payload);
+    // Requests that change state run once per (client, seq), retransmissions get the first reply
+    int once = cmd == METRIC_RESERVER || cmd == METRIC_ANNULER || cmd == METRIC_ITINERAIRE;
+    if (once && udp_reply_begin(sockfd, cli_addr, cli_len, header.seq)) {
+        return;
+    }
+    uint64_t start = metrics_now_ns();
     if (strncmp(payload, "LIST", 4) == 0) {
-        sendVols(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq);
+        unsigned long long version;
+        int used;
+        if (sscanf(payload + 4, "%llu%n", &version, &used) == 1) {
+            // "LIST <version> <index> ...": chunks lost on the way
+            uint32_t wanted[LIST_MAX_RESEND];
+            int nb_wanted = 0;
+            const char *p = payload + 4 + used;
+            unsigned int index;
+            while (nb_wanted < LIST_MAX_RESEND && sscanf(p, "%u%n", &index, &used) == 1) {
+                wanted[nb_wanted++] = index;
+                p += used;
+            }
+            sendVolsChunks(sockfd, cli_addr, cli_len, header.seq, version, wanted, nb_wanted);
+        } else {
+            sendVols(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq);
+        }
+    } else if (strncmp(payload, "PAGE", 4) == 0) {
+        char cursor[LIST_CURSOR_SIZE];
+        int size;
+        parse_page(payload + 4, cursor, &size);
+        sendVolsPage(sockfd, cli_addr, cli_len, cursor[0] ? cursor : NULL, size, PROTO_UDP, header.seq);
     } else if (strncmp(payload, "RESERVER", 8) == 0) {
         int ref, nb;
         char agence[50];
-        if (sscanf(payload + 9, "%d %d %s", &ref, &nb, agence) == 3) {
+        if (parse_booking(payload + 9, &ref, &nb, agence) == 0) {
             reserverVol(sockfd, cli_addr, cli_len, ref, nb, agence, PROTO_UDP, header.seq);
         } else {
-            char err[] = "Invalid RESERVER command\n";
-            UdpHeader header_out = { header.seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header_out, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sockfd, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+            send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Invalid RESERVER command\n"));
             debug_print("Invalid RESERVER command", cli_addr, sockfd);
+            metrics_failed = 1;
         }
     } else if (strncmp(payload, "ANNULER", 7) == 0) {
         int ref, nb;
         char agence[50];
-        if (sscanf(payload + 8, "%d %d %s", &ref, &nb, agence) == 3) {
+        if (parse_booking(payload + 8, &ref, &nb, agence) == 0) {
             annulerVol(sockfd, cli_addr, cli_len, ref, nb, agence, PROTO_UDP, header.seq);
         } else {
-            char err[] = "Invalid ANNULER command\n";
-            UdpHeader header_out = { header.seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header_out, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sockfd, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+            send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Invalid ANNULER command\n"));
             debug_print("Invalid ANNULER command", cli_addr, sockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(payload, "ITINERAIRE", 10) == 0) {
+        int nb, refs[ITINERAIRE_MAX_LEGS];
+        char agence[50];
+        int nb_refs = parse_itineraire(payload + 10, &nb, agence, refs);
+        if (nb_refs > 0) {
+            reserverItineraire(sockfd, cli_addr, cli_len, refs, nb_refs, nb, agence, PROTO_UDP, header.seq);
+        } else {
+            send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Invalid ITINERAIRE command\n"));
+            debug_print("Invalid ITINERAIRE command", cli_addr, sockfd);
+            metrics_failed = 1;
+        }
+    } else if (strncmp(payload, "SEARCH", 6) == 0) {
+        char dest[VOL_DEST_SIZE];
+        int prix_min, prix_max, places_min;
+        if (parse_search(payload + 6, dest, &prix_min, &prix_max, &places_min) == 0) {
+            rechercherVols(sockfd, cli_addr, cli_len, strcmp(dest, "*") == 0 ? NULL : dest, prix_min, prix_max, places_min, PROTO_UDP, header.seq);
+        } else {
+            send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Invalid SEARCH command\n"));
+            debug_print("Invalid SEARCH command", cli_addr, sockfd);
+            metrics_failed = 1;
         }
     } else if (strncmp(payload, "FACTURE", 7) == 0) {
         char ag[50];
-        if (sscanf(payload + 8, "%s", ag) == 1) {
+        if (parse_agence(payload + 8, ag) == 0) {
             consulterFacture(sockfd, cli_addr, cli_len, ag, PROTO_UDP, header.seq);
         } else {
-            char err[] = "Invalid FACTURE command\n";
-            UdpHeader header_out = { header.seq, "ERR", (uint32_t)strlen(err) };
-            char packet[MAX_DATAGRAM_SIZE];
-            memcpy(packet, &header_out, sizeof(UdpHeader));
-            memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-            sendto(sockfd, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+            send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Invalid FACTURE command\n"));
             debug_print("Invalid FACTURE command", cli_addr, sockfd);
+            metrics_failed = 1;
         }
     } else {
-        char err[] = "Unknown command\n";
-        UdpHeader header_out = { header.seq, "ERR", (uint32_t)strlen(err) };
-        char packet[MAX_DATAGRAM_SIZE];
-        memcpy(packet, &header_out, sizeof(UdpHeader));
-        memcpy(packet + sizeof(UdpHeader), err, strlen(err));
-        sendto(sockfd, packet, sizeof(UdpHeader) + strlen(err), 0, (struct sockaddr *)cli_addr, cli_len);
+        send_reply(sockfd, cli_addr, cli_len, PROTO_UDP, header.seq, "ERR", REPLY_TEXT("Unknown command\n"));
         debug_print("Unknown command received", cli_addr, sockfd);
+        metrics_failed = 1;
+    }
+    if (once) {
+        udp_reply_end();
+    }
+    metrics_record(cmd, start);
+}
+
+// Multi-threaded UDP server: every thread owns a SO_REUSEPORT socket bound to the same port,
+// the kernel spreads clients over them and each thread batches with recvmmsg/sendmmsg
+void *udp_worker_thread(void *arg) {
+    int sockfd = (int)(intptr_t)arg;
+    UdpBatch *out = calloc(1, sizeof(UdpBatch));
+    if (!out) {
+        perror("Failed to allocate UDP reply batch");
+        return NULL;
+    }
+    out->sock = sockfd;
+    udp_out = out;
+    journal_defer = 1; // One journal wait per batch, in udp_flush
+
+    char buffers[UDP_BATCH][MAX_DATAGRAM_SIZE + 1];
+    struct sockaddr_in addrs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovs[i].iov_base = buffers[i];
+            iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(sockfd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("Failed to receive UDP batch");
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            handle_udp_request(sockfd, buffers[i], msgs[i].msg_len, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        }
+        udp_flush(out);
     }
+    return NULL;
+}
+
+int run_udp_mt_server(int nb_threads) {
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(PORT);
+
+    pthread_t threads[nb_threads];
+    for (int i = 0; i < nb_threads; i++) {
+        int sockfd = create_socket(PROTO_UDP);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+            bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+            perror("Failed to bind SO_REUSEPORT socket");
+            close(sockfd);
+            return -1;
+        }
+        if (pthread_create(&threads[i], NULL, udp_worker_thread, (void *)(intptr_t)sockfd) != 0) {
+            perror("Failed to create UDP worker");
+            close(sockfd);
+            return -1;
+        }
+    }
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
 }
 
+#ifndef SERVEUR_NO_MAIN // bench.c includes this file and brings its own main
 int main(int argc, char *argv[]) {
-    if (argc != 2 || (strcmp(argv[1], "tcp") != 0 && strcmp(argv[1], "udp") != 0)) {
-        fprintf(stderr, "Usage: %s <tcp|udp>\n", argv[0]);
+    if (log_init() < 0) {
+        return 1;
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "import") == 0) {
+        // Rebuild the flight store from a text file
+        return vol_store_import(argc == 3 ? argv[2] : VOL_FILE, VOL_STORE_FILE) < 0 ? 1 : 0;
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "export") == 0) {
+        // Current seats: the store plus the journal records newer than the last checkpoint. Never
+        // imports a missing store, and only writes a file, even VOL_FILE, when it is named.
+        if (chargerVols(VOL_STORE_FILE, NULL) < 0 || chargerFactures(FACTURE_FILE) < 0) {
+            return 1;
+        }
+        vol_store_detach();
+        if (journal_replay(JOURNAL_SEGMENT_FILE) < 0 || journal_replay(JOURNAL_FILE) < 0) {
+            return 1;
+        }
+        return vol_store_export(argc == 3 ? argv[2] : NULL) < 0 ? 1 : 0;
+    }
+    // "sharded" after the mode: flights owned by per-core shard threads instead of flight locks
+    int sharded = argc >= 3 && argc <= 4 && strcmp(argv[argc - 1], "sharded") == 0;
+    if (sharded) {
+        argc--;
+    }
+    if (argc < 2 || argc > 3 || (strcmp(argv[1], "tcp") != 0 && strcmp(argv[1], "udp") != 0)) {
+        fprintf(stderr, "Usage: %s tcp [thread|epoll] [sharded] | %s udp [single|mt] [sharded] | %s import|export [file]\n", argv[0], argv[0], argv[0]);
         return 1;
     }
     Protocol proto = strcmp(argv[1], "tcp") == 0 ? PROTO_TCP : PROTO_UDP;
+    TcpMode tcp_mode = TCP_THREAD;
+    UdpMode udp_mode = UDP_SINGLE;
+    if (argc == 3) {
+        if (proto == PROTO_TCP && strcmp(argv[2], "epoll") == 0) {
+            tcp_mode = TCP_EPOLL;
+        } else if (proto == PROTO_UDP && strcmp(argv[2], "mt") == 0) {
+            udp_mode = UDP_MULTI;
+        } else if (strcmp(argv[2], proto == PROTO_TCP ? "thread" : "single") != 0) {
+            fprintf(stderr, "Usage: %s tcp [thread|epoll] [sharded] | %s udp [single|mt] [sharded]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    // Map flights, load invoices in memory, replay the journal and start the group commit thread
+    if (chargerVols(VOL_STORE_FILE, VOL_FILE) < 0 || chargerFactures(FACTURE_FILE) < 0 || journal_open(JOURNAL_FILE) < 0 ||
+        histo_open(HISTO_FILE) < 0) {
+        return 1;
+    }
+    pthread_t journal_thread;
+    if (pthread_create(&journal_thread, NULL, journal_writer_thread, NULL) != 0) {
+        perror("Failed to create journal thread");
+        return 1;
+    }
+    pthread_detach(journal_thread);
+    cpu_set_t allowed;
+    if (sharded && shards_start(cpus_allowed(&allowed)) < 0) {
+        return 1;
+    }
+    if (metrics_init() < 0) {
+        return 1;
+    }
+    // Tables of the replies that retried bookings get again, one per transport
+    if ((proto == PROTO_UDP && reply_cache_init(&udp_replies, REPLY_CACHE_SIZE, MAX_DATAGRAM_SIZE) < 0) ||
+        (proto == PROTO_TCP && reply_cache_init(&tcp_keys, env_size("TCP_KEYS", TCP_KEYS), TCP_KEY_REPLY_SIZE) < 0)) {
+        return 1;
+    }
+
+    if (proto == PROTO_UDP && udp_mode == UDP_MULTI) {
+        int nb_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nb_threads < 1) {
+            nb_threads = 1;
+        }
+        printf("Starting UDP server on port %d (%d SO_REUSEPORT threads)...\n", PORT, nb_threads);
+        run_udp_mt_server(nb_threads);
+        return 1;
+    }
 
     int sockfd = -1;
     struct sockaddr_in serv_addr, cli_addr;
@@ -664,38 +3783,41 @@ int main(int argc, char *argv[]) {
 
     if (proto == PROTO_TCP) {
         // Listen for connections
-        if (listen(sockfd, 5) < 0) {
+        if (listen(sockfd, LISTEN_BACKLOG) < 0) {
             perror("Failed to listen on socket");
             close(sockfd);
             return 1;
         }
+        tcp_workers = (int)env_size("TCP_WORKERS", EPOLL_WORKERS);
+        tcp_queue_size = env_size("TCP_QUEUE_SIZE", TCP_QUEUE_SIZE);
+        tcp_max_clients = env_size("TCP_MAX_CLIENTS", TCP_MAX_CLIENTS);
+        if (tcp_mode == TCP_EPOLL) {
+            printf("Starting TCP server on port %d (epoll, %d workers)...\n", PORT, tcp_workers);
+            log_printf(LOG_INFO, NULL, sockfd, "TCP epoll server started");
+            run_epoll_server(sockfd);
+            close(sockfd);
+            return 1;
+        }
         printf("Starting TCP server on port %d...\n", PORT);
-        debug_print("TCP server started", NULL, sockfd);
+        log_printf(LOG_INFO, NULL, sockfd, "TCP server started");
 
         while (1) {
-            int *newsockfd = malloc(sizeof(int));
-            if (!newsockfd) {
-                perror("Failed to allocate memory for client socket");
+            int newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+            if (newsockfd < 0) {
+                perror("Failed to accept client connection");
                 continue;
             }
-            *newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-            if (*newsockfd < 0) {
-                perror("Failed to accept client connection");
-                free(newsockfd);
+            if (tcp_client_admit(newsockfd, &cli_addr) < 0) {
                 continue;
             }
-            char debug_msg[BUFFER_SIZE];
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &cli_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-            snprintf(debug_msg, sizeof(debug_msg), "New client connected: %s:%d", client_ip, ntohs(cli_addr.sin_port));
-            debug_print(debug_msg, NULL, *newsockfd);
+            log_printf(LOG_INFO, &cli_addr, newsockfd, "New client connected");
 
             // Create a new thread for the client
             pthread_t thread;
-            if (pthread_create(&thread, NULL, handle_tcp_client, newsockfd) != 0) {
+            if (pthread_create(&thread, NULL, handle_tcp_client, (void *)(intptr_t)newsockfd) != 0) {
                 perror("Failed to create client thread");
-                close(*newsockfd);
-                free(newsockfd);
+                close(newsockfd);
+                __atomic_sub_fetch(&tcp_clients, 1, __ATOMIC_RELAXED);
                 continue;
             }
 
@@ -706,11 +3828,10 @@ int main(int argc, char *argv[]) {
         }
     } else {
         printf("Starting UDP server on port %d...\n", PORT);
-        debug_print("UDP server started", NULL, sockfd);
-        char buffer[MAX_DATAGRAM_SIZE];
+        log_printf(LOG_INFO, NULL, sockfd, "UDP server started");
+        char buffer[MAX_DATAGRAM_SIZE + 1];
 
         while (1) {
-            memset(buffer, 0, MAX_DATAGRAM_SIZE);
             ssize_t n = recvfrom(sockfd, buffer, MAX_DATAGRAM_SIZE, 0, (struct sockaddr *)&cli_addr, &clilen);
             if (n < 0) {
                 perror("Failed to receive UDP packet");
@@ -722,8 +3843,7 @@ int main(int argc, char *argv[]) {
 
     close(sockfd);
     debug_print("Server socket closed", NULL, sockfd);
-    pthread_mutex_destroy(&vols_mutex);
     pthread_mutex_destroy(&histo_mutex);
-    pthread_mutex_destroy(&facture_mutex);
     return 0;
 }
+#endif